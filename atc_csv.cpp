@@ -0,0 +1,42 @@
+#include "atc_csv.hpp"
+#include "normalize.hpp"
+
+#include <vector>
+
+atc_index_map get_atc_tree_index(std::istream& ist){
+    atc_index_map atc_line;
+    uint16_t ATC_index = 0;
+
+    //get the header of the CSV file
+    std::string header;
+    std::getline(ist, header);
+
+    for(std::string line; std::getline(ist, line); )
+        atc_line.insert({line.substr(0, line.find(',')), ATC_index++});
+
+    return atc_line;
+}
+
+atc_binder_map get_atc_from_standardized(std::istream& ist){
+    atc_binder_map returned_map;
+
+    std::string header;
+    std::getline(ist, header);
+
+    std::vector<std::string> current_row;
+    for(std::string line; std::getline(ist, line); ){
+        std::size_t pos;
+        while((pos = line.find(';')) != std::string::npos){
+            current_row.push_back(line.substr(0, pos));
+            line.erase(0, pos + 1);
+        }
+        //we are interested in the susbtance name + ATC primary code so index 1 and 3 of the csv file
+        if(current_row.size() >= 4){
+            normalize_ascii(current_row[1]);
+            returned_map.insert({current_row[1], current_row[3]});
+        }
+        current_row.clear();
+    }
+
+    return returned_map;
+}
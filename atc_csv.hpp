@@ -0,0 +1,24 @@
+#ifndef FAERS_ATC_CSV_HPP
+#define FAERS_ATC_CSV_HPP
+
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <map>
+#include <string>
+
+using atc_index_map = std::map<std::string, uint16_t, std::less<>>;
+using atc_binder_map = std::map<std::string, std::string, std::less<>>;
+
+//parsers of the ATC CSV files, shared by the build step (tools/embed_tables.cpp)
+//and the --atc-tree / --atc-binder overrides so that both give the same tables
+
+//ATC_tree.csv : header skipped, the code is the first column, its index is the
+//row number and the first occurrence of a code wins
+atc_index_map get_atc_tree_index(std::istream& ist);
+
+//ATC binder : header skipped, substance (normalized) in column 1 and primary
+//ATC code in column 3, rows with less than 4 columns are ignored
+atc_binder_map get_atc_from_standardized(std::istream& ist);
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef FAERS_BOUNDED_QUEUE_HPP
+#define FAERS_BOUNDED_QUEUE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+//bounded multi producer / multi consumer queue (D. Vyukov's array of sequenced
+//cells), push and pop are lock free. A full (empty) queue makes push (pop) wait
+//on an epoch counter bumped by the other side, so idle stages do not spin.
+//close() is called once every producer is done, pop then drains the queue and returns false
+template<typename T>
+class bounded_queue{
+public:
+    explicit bounded_queue(std::size_t capacity)
+        : mask_{std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1},
+          cells_{std::make_unique<cell[]>(mask_ + 1)}{
+        for(std::size_t i = 0; i <= mask_; ++i)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(T& value){
+        std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        cell* c;
+        while(true){
+            c = &cells_[pos & mask_];
+            std::size_t seq = c->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if(diff == 0){
+                if(enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }else if(diff < 0){
+                return false;
+            }else{
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        c->value = std::move(value);
+        c->sequence.store(pos + 1, std::memory_order_release);
+        signal(push_epoch_);
+        return true;
+    }
+
+    bool try_pop(T& value){
+        std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        cell* c;
+        while(true){
+            c = &cells_[pos & mask_];
+            std::size_t seq = c->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+            if(diff == 0){
+                if(dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }else if(diff < 0){
+                return false;
+            }else{
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(c->value);
+        c->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        signal(pop_epoch_);
+        return true;
+    }
+
+    void push(T value){
+        while(true){
+            uint32_t epoch = pop_epoch_.load(std::memory_order_acquire);
+            if(try_push(value))
+                return;
+            pop_epoch_.wait(epoch, std::memory_order_acquire);
+        }
+    }
+
+    bool pop(T& value){
+        while(true){
+            uint32_t epoch = push_epoch_.load(std::memory_order_acquire);
+            if(try_pop(value))
+                return true;
+            if(closed_.load(std::memory_order_acquire))
+                return try_pop(value);
+            push_epoch_.wait(epoch, std::memory_order_acquire);
+        }
+    }
+
+    void close(){
+        closed_.store(true, std::memory_order_release);
+        signal(push_epoch_);
+    }
+
+private:
+    struct cell{
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    static void signal(std::atomic<uint32_t>& epoch){
+        epoch.fetch_add(1, std::memory_order_release);
+        epoch.notify_all();
+    }
+
+    const std::size_t mask_;
+    std::unique_ptr<cell[]> cells_;
+    alignas(64) std::atomic<std::size_t> enqueue_pos_{0};
+    alignas(64) std::atomic<std::size_t> dequeue_pos_{0};
+    alignas(64) std::atomic<uint32_t> push_epoch_{0};
+    alignas(64) std::atomic<uint32_t> pop_epoch_{0};
+    std::atomic<bool> closed_{false};
+};
+
+#endif
@@ -0,0 +1,549 @@
+#include "faers_reader.hpp"
+#include "normalize.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+constexpr std::size_t npos = std::string::npos;
+constexpr std::size_t buffer_size = 1 << 20;
+
+//elements which can appear several times in a report, the values of the
+//fields below them are kept aligned (one value per drug, one per reaction)
+constexpr std::string_view repeated_elements[] = {"patient/drug", "patient/reaction"};
+
+const std::vector<field_spec> known_fields = {
+    {"safetyreportid", "safetyreportid"},
+    {"receivedate", "receivedate"},
+    {"receiptdate", "receiptdate"},
+    {"serious", "serious"},
+    {"occurcountry", "occurcountry"},
+    {"primarysourcecountry", "primarysourcecountry"},
+    {"reporttype", "reporttype"},
+    {"patientsex", "patient/patientsex"},
+    {"patientonsetage", "patient/patientonsetage"},
+    {"patientonsetageunit", "patient/patientonsetageunit"},
+    {"patientweight", "patient/patientweight"},
+    {"medicinalproduct", "patient/drug/medicinalproduct", true},
+    {"drugcharacterization", "patient/drug/drugcharacterization"},
+    {"activesubstancename", "patient/drug/activesubstance/activesubstancename", true},
+    {"reactionmeddrapt", "patient/reaction/reactionmeddrapt", true},
+};
+
+std::string_view trim(std::string_view s){
+    std::size_t first = s.find_first_not_of(" \t");
+    if(first == npos)
+        return {};
+    return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+}
+
+std::string_view strip_quotes(std::string_view s){
+    if(s.size() >= 2 && (s.front() == '"' || s.front() == '\'') && s.back() == s.front())
+        return s.substr(1, s.size() - 2);
+    return s;
+}
+
+bool parse_number(std::string_view s, double& number){
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), number);
+    return !s.empty() && ec == std::errc{} && end == s.data() + s.size();
+}
+
+void append_utf8(std::string& out, uint32_t cp){
+    if(cp < 0x80){
+        out += char(cp);
+    }else if(cp < 0x800){
+        out += char(0xc0 | (cp >> 6));
+        out += char(0x80 | (cp & 0x3f));
+    }else if(cp < 0x10000){
+        out += char(0xe0 | (cp >> 12));
+        out += char(0x80 | ((cp >> 6) & 0x3f));
+        out += char(0x80 | (cp & 0x3f));
+    }else{
+        out += char(0xf0 | (cp >> 18));
+        out += char(0x80 | ((cp >> 12) & 0x3f));
+        out += char(0x80 | ((cp >> 6) & 0x3f));
+        out += char(0x80 | (cp & 0x3f));
+    }
+}
+
+//append raw character data to out, replacing the XML entities
+void append_decoded(std::string& out, std::string_view raw){
+    std::size_t amp;
+    while((amp = raw.find('&')) != npos){
+        out.append(raw.substr(0, amp));
+        raw.remove_prefix(amp);
+        std::size_t semi = raw.find(';');
+        if(semi == npos)
+            break;
+        std::string_view entity = raw.substr(1, semi - 1);
+        uint32_t cp = 0;
+        if(entity == "amp")
+            out += '&';
+        else if(entity == "lt")
+            out += '<';
+        else if(entity == "gt")
+            out += '>';
+        else if(entity == "quot")
+            out += '"';
+        else if(entity == "apos")
+            out += '\'';
+        else if(entity.starts_with("#x") &&
+                std::from_chars(entity.data() + 2, entity.data() + entity.size(), cp, 16).ec == std::errc{})
+            append_utf8(out, cp);
+        else if(entity.starts_with('#') &&
+                std::from_chars(entity.data() + 1, entity.data() + entity.size(), cp).ec == std::errc{})
+            append_utf8(out, cp);
+        else
+            out.append(raw.substr(0, semi + 1));
+        raw.remove_prefix(semi + 1);
+    }
+    out.append(raw);
+}
+
+}
+
+field_spec field_list::lookup(std::string_view name){
+    auto it = std::find_if(known_fields.begin(), known_fields.end(),
+                           [&](const field_spec& f){ return f.name == name; });
+    if(it != known_fields.end())
+        return *it;
+    return {std::string(name), std::string(name)};
+}
+
+bool field_list::is_known(std::string_view name){
+    return std::any_of(known_fields.begin(), known_fields.end(),
+                       [&](const field_spec& f){ return f.name == name; });
+}
+
+std::size_t field_list::add(std::string_view name){
+    field_spec spec = lookup(name);
+    auto it = std::find_if(fields_.begin(), fields_.end(),
+                           [&](const field_spec& f){ return f.path == spec.path; });
+    if(it != fields_.end())
+        return std::distance(fields_.begin(), it);
+    fields_.push_back(spec);
+    return fields_.size() - 1;
+}
+
+std::optional<std::size_t> field_list::index_of(std::string_view name) const{
+    std::string path = lookup(name).path;
+    auto it = std::find_if(fields_.begin(), fields_.end(),
+                           [&](const field_spec& f){ return f.path == path; });
+    if(it == fields_.end())
+        return std::nullopt;
+    return std::distance(fields_.begin(), it);
+}
+
+bool field_condition::test(std::string_view value) const{
+    auto compare = [value](const std::string& expected){
+        double lhs, rhs;
+        if(parse_number(value, lhs) && parse_number(expected, rhs))
+            return lhs < rhs ? -1 : (lhs > rhs ? 1 : 0);
+        int result = value.compare(expected);
+        return result < 0 ? -1 : (result > 0 ? 1 : 0);
+    };
+
+    switch(operation){
+    case op::eq:
+        return compare(values[0]) == 0;
+    case op::ne:
+        return compare(values[0]) != 0;
+    case op::lt:
+        return compare(values[0]) < 0;
+    case op::le:
+        return compare(values[0]) <= 0;
+    case op::gt:
+        return compare(values[0]) > 0;
+    case op::ge:
+        return compare(values[0]) >= 0;
+    case op::in:
+        return std::any_of(values.begin(), values.end(),
+                           [&](const std::string& v){ return compare(v) == 0; });
+    }
+    return false;
+}
+
+bool report_filter::add(std::string_view expression, field_list& fields){
+    expression = trim(expression);
+    std::size_t name_end = expression.find_first_of("=!<> \t(");
+    if(name_end == 0 || name_end == npos)
+        return false;
+    std::string_view name = expression.substr(0, name_end);
+    std::string_view rest = trim(expression.substr(name_end));
+
+    constexpr std::pair<std::string_view, field_condition::op> operators[] = {
+        {">=", field_condition::op::ge}, {"<=", field_condition::op::le},
+        {"!=", field_condition::op::ne}, {"==", field_condition::op::eq},
+        {"=", field_condition::op::eq}, {"<", field_condition::op::lt},
+        {">", field_condition::op::gt}, {"in", field_condition::op::in},
+        {"IN", field_condition::op::in},
+    };
+    auto it = std::find_if(std::begin(operators), std::end(operators),
+                           [&](const auto& o){ return rest.starts_with(o.first); });
+    if(it == std::end(operators))
+        return false;
+
+    field_condition condition;
+    condition.operation = it->second;
+    rest = trim(rest.substr(it->first.size()));
+    if(condition.operation == field_condition::op::in){
+        //in (value1,value2,...)
+        if(!rest.starts_with('(') || !rest.ends_with(')'))
+            return false;
+        rest = rest.substr(1, rest.size() - 2);
+        while(!rest.empty()){
+            std::size_t comma = rest.find(',');
+            condition.values.emplace_back(strip_quotes(trim(rest.substr(0, comma))));
+            rest = comma == npos ? std::string_view{} : rest.substr(comma + 1);
+        }
+    }else{
+        if(!rest.empty() && std::string_view("=!<>").find(rest.front()) != npos)
+            return false;
+        condition.values.emplace_back(strip_quotes(rest));
+    }
+    if(condition.values.empty())
+        return false;
+
+    //a typo in a known name would silently reject every report
+    if(!field_list::is_known(name) && name.find('/') == npos)
+        std::cerr << "Warning: --where field " << name << " is not a known field name, it is read as the element <"
+                  << name << "> directly below <safetyreport>.\n";
+    condition.field = fields.add(name);
+    //the values of a normalized field are compared once normalized (see close_element)
+    if(fields[condition.field].normalize){
+        for(auto& value : condition.values)
+            normalize_ascii(value);
+    }
+    conditions_.push_back(std::move(condition));
+    return true;
+}
+
+report_reader::report_reader(const std::string& path, const field_list& fields,
+                             const report_filter& filter)
+    : ist_(path, std::ios::binary), buffer_(buffer_size), fields_{fields},
+      group_start_(fields.size(), 0), conditions_{filter.conditions()}{
+    //build the tree of the elements leading to a requested field, rooted at <safetyreport>
+    nodes_.emplace_back();
+    std::vector<std::size_t> field_group(fields.size(), 0);
+    for(std::size_t i = 0; i < fields.size(); ++i){
+        std::string_view rest = fields[i].path;
+        std::size_t n = 0, group = 0;
+        while(!rest.empty()){
+            std::size_t slash = rest.find('/');
+            std::string_view name = rest.substr(0, slash);
+            rest = slash == npos ? std::string_view{} : rest.substr(slash + 1);
+
+            auto it = nodes_[n].children.find(name);
+            if(it == nodes_[n].children.end()){
+                nodes_.emplace_back();
+                it = nodes_[n].children.emplace(std::string(name), nodes_.size() - 1).first;
+            }
+            n = it->second;
+
+            std::string_view prefix(fields[i].path.data(), name.data() + name.size() - fields[i].path.data());
+            if(!rest.empty() && std::ranges::find(repeated_elements, prefix) != std::end(repeated_elements))
+                group = n;
+        }
+        nodes_[n].field = i;
+        nodes_[group].group_fields.push_back(i);
+        field_group[i] = group;
+    }
+
+    //each condition is checked when the element holding its values closes,
+    //the ones on header fields are also checked before reading the rest of the report
+    for(const auto& condition : conditions_){
+        std::size_t group = field_group[condition.field];
+        if(group != 0 && nodes_[group].conditions.empty())
+            filtered_groups_.push_back(group);
+        nodes_[group].conditions.push_back(&condition);
+        if(fields[condition.field].path.find('/') == npos)
+            header_conditions_.push_back(&condition);
+    }
+}
+
+bool report_reader::refill(){
+    std::size_t size = end_ - begin_;
+    std::memmove(buffer_.data(), buffer_.data() + begin_, size);
+    begin_ = 0;
+    end_ = size;
+    if(end_ == buffer_.size())
+        buffer_.resize(buffer_.size() * 2);
+    ist_.read(buffer_.data() + end_, buffer_.size() - end_);
+    end_ += ist_.gcount();
+    return end_ > size;
+}
+
+//the find functions return an offset from begin_, refilling the buffer as needed
+std::size_t report_reader::find(char c, std::size_t offset){
+    while(true){
+        if(begin_ + offset < end_){
+            const char* start = buffer_.data() + begin_;
+            auto found = static_cast<const char*>(std::memchr(start + offset, c, end_ - begin_ - offset));
+            if(found)
+                return found - start;
+            offset = end_ - begin_;
+        }
+        if(!refill())
+            return npos;
+    }
+}
+
+std::size_t report_reader::find(std::string_view s, std::size_t offset){
+    while(true){
+        std::string_view data(buffer_.data() + begin_, end_ - begin_);
+        std::size_t pos = data.find(s, offset);
+        if(pos != npos)
+            return pos;
+        if(data.size() >= s.size())
+            offset = std::max(offset, data.size() - s.size() + 1);
+        if(!refill())
+            return npos;
+    }
+}
+
+//position of the '>' closing a tag, ignoring the ones in attribute values
+std::size_t report_reader::find_tag_end(std::size_t offset){
+    char quote = 0;
+    for(std::size_t i = offset; ; ++i){
+        if(begin_ + i >= end_ && !refill())
+            return npos;
+        char c = buffer_[begin_ + i];
+        if(quote){
+            if(c == quote)
+                quote = 0;
+        }else if(c == '"' || c == '\''){
+            quote = c;
+        }else if(c == '>'){
+            return i;
+        }
+    }
+}
+
+bool report_reader::starts_with(std::string_view s){
+    while(end_ - begin_ < s.size())
+        if(!refill())
+            return false;
+    return std::string_view(buffer_.data() + begin_, s.size()) == s;
+}
+
+//consume the character data up to the next tag, decoded into text when it is not null
+void report_reader::read_text(std::string* text){
+    std::size_t pos = find('<');
+    if(pos == npos)
+        pos = end_ - begin_;
+    if(text)
+        append_decoded(*text, std::string_view(buffer_.data() + begin_, pos));
+    begin_ += pos;
+}
+
+//consume the markup starting at begin_, CDATA content is appended to text when it is not null
+report_reader::tag report_reader::read_tag(std::string* text){
+    tag t;
+    if(!starts_with("<"))
+        return t;
+    while(end_ - begin_ < 2)
+        if(!refill())
+            return t;
+
+    std::size_t end;
+    const char second = buffer_[begin_ + 1];
+    if(second == '/'){
+        if((end = find('>', 2)) == npos)
+            return t;
+        t.kind = tag_kind::end;
+        t.name = std::string_view(buffer_.data() + begin_ + 2, end - 2);
+        t.name = t.name.substr(0, t.name.find_first_of(" \t\r\n"));
+        begin_ += end + 1;
+    }else if(second == '?'){
+        if((end = find("?>", 2)) == npos)
+            return t;
+        t.kind = tag_kind::other;
+        begin_ += end + 2;
+    }else if(starts_with("<!--")){
+        if((end = find("-->", 4)) == npos)
+            return t;
+        t.kind = tag_kind::other;
+        begin_ += end + 3;
+    }else if(starts_with("<![CDATA[")){
+        if((end = find("]]>", 9)) == npos)
+            return t;
+        if(text)
+            text->append(buffer_.data() + begin_ + 9, end - 9);
+        t.kind = tag_kind::text;
+        begin_ += end + 3;
+    }else{
+        if((end = find_tag_end(1)) == npos)
+            return t;
+        if(second == '!'){
+            t.kind = tag_kind::other;
+        }else{
+            t.kind = buffer_[begin_ + end - 1] == '/' ? tag_kind::empty : tag_kind::start;
+            t.name = std::string_view(buffer_.data() + begin_ + 1, end - 1);
+            t.name = t.name.substr(0, t.name.find_first_of(" \t\r\n/"));
+        }
+        begin_ += end + 1;
+    }
+    return t;
+}
+
+//skip everything up to the end tag of the element which has just been opened
+void report_reader::skip_subtree(){
+    std::size_t depth = 1;
+    while(depth > 0){
+        std::size_t pos = find('<');
+        if(pos == npos){
+            begin_ = end_;
+            return;
+        }
+        begin_ += pos;
+        switch(read_tag(nullptr).kind){
+        case tag_kind::start:
+            ++depth;
+            break;
+        case tag_kind::end:
+            --depth;
+            break;
+        case tag_kind::eof:
+            return;
+        default:
+            break;
+        }
+    }
+}
+
+void report_reader::open_element(std::size_t n, report_record& record){
+    for(auto f : nodes_[n].group_fields)
+        group_start_[f] = record.values[f].size();
+}
+
+//store the value of a field (only the first one of each report / drug / reaction)
+//and give an empty value to the fields of the group which were absent
+void report_reader::close_element(std::size_t n, std::string& text, report_record& record){
+    if(auto f = nodes_[n].field){
+        auto& values = record.values[*f];
+        if(values.size() == group_start_[*f]){
+            text_flags flags;
+            if(fields_[*f].normalize)
+                flags = normalize_ascii(text);
+            values.push_back(std::move(text));
+            record.flags[*f].push_back(flags);
+        }
+    }
+    for(auto f : nodes_[n].group_fields){
+        if(record.values[f].size() == group_start_[f]){
+            record.values[f].emplace_back();
+            record.flags[f].emplace_back();
+        }
+    }
+
+    if(n == 0){
+        report_rejected_ = !check(nodes_[0].conditions, record) ||
+            std::any_of(filtered_groups_.begin(), filtered_groups_.end(), [&](std::size_t g){
+                return record.values[nodes_[g].conditions.front()->field].empty();
+            });
+    }else if(!check(nodes_[n].conditions, record)){
+        //drop this drug / reaction
+        for(auto f : nodes_[n].group_fields){
+            record.values[f].resize(group_start_[f]);
+            record.flags[f].resize(group_start_[f]);
+        }
+    }
+}
+
+//the header conditions can be checked once all their fields have been read,
+//or when the patient starts since the header fields come before it
+bool report_reader::header_ready(const report_record& record, std::string_view next_tag) const{
+    return next_tag == "patient" ||
+        std::all_of(header_conditions_.begin(), header_conditions_.end(),
+                    [&](const field_condition* c){ return !record.values[c->field].empty(); });
+}
+
+//test the conditions on the current occurrence of their group
+bool report_reader::check(const std::vector<const field_condition*>& conditions,
+                          const report_record& record) const{
+    for(const auto* condition : conditions){
+        const auto& values = record.values[condition->field];
+        std::size_t occurrence = group_start_[condition->field];
+        if(!condition->test(occurrence < values.size() ? values[occurrence] : std::string_view{}))
+            return false;
+    }
+    return true;
+}
+
+void report_reader::read_element(std::size_t n, report_record& record){
+    open_element(n, record);
+    std::string text;
+    std::string* wanted_text = nodes_[n].field ? &text : nullptr;
+    while(true){
+        read_text(wanted_text);
+        tag t = read_tag(wanted_text);
+        if(t.kind == tag_kind::eof)
+            return;
+        if(t.kind == tag_kind::end)
+            break;
+        if(t.kind != tag_kind::start && t.kind != tag_kind::empty)
+            continue;
+
+        if(n == 0 && !header_checked_ && !header_conditions_.empty() && header_ready(record, t.name)){
+            header_checked_ = true;
+            if(!check(header_conditions_, record)){
+                //rejected on its header : the rest of the report is never tokenized
+                report_rejected_ = true;
+                if(t.kind == tag_kind::start)
+                    skip_subtree();
+                skip_subtree();
+                return;
+            }
+        }
+
+        auto it = nodes_[n].children.find(t.name);
+        if(it == nodes_[n].children.end()){
+            if(t.kind == tag_kind::start)
+                skip_subtree();
+        }else if(t.kind == tag_kind::start){
+            read_element(it->second, record);
+        }else{
+            std::string empty;
+            open_element(it->second, record);
+            close_element(it->second, empty, record);
+        }
+    }
+    close_element(n, text, record);
+}
+
+bool report_reader::next(report_record& record){
+    record.values.resize(fields_.size());
+    record.flags.resize(fields_.size());
+
+    while(true){
+        std::size_t pos = find('<');
+        if(pos == npos)
+            return false;
+        begin_ += pos;
+        tag t = read_tag(nullptr);
+        if(t.kind == tag_kind::eof)
+            return false;
+        if(t.kind != tag_kind::start)
+            continue;
+        if(t.name == "safetyreport"){
+            for(auto& values : record.values)
+                values.clear();
+            for(auto& flags : record.flags)
+                flags.clear();
+            header_checked_ = false;
+            report_rejected_ = false;
+            read_element(0, record);
+            if(!report_rejected_)
+                return true;
+            ++rejected_;
+            continue;
+        }
+        //everything outside the reports except their <ichicsr> parent is skipped (message header ...)
+        if(t.name != "ichicsr")
+            skip_subtree();
+    }
+}
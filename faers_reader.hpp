@@ -0,0 +1,164 @@
+#ifndef FAERS_READER_HPP
+#define FAERS_READER_HPP
+
+#include <cstddef>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "normalize.hpp"
+
+//a field extracted from each <safetyreport>, path is relative to <safetyreport>
+//fields under patient/drug and patient/reaction have one value per drug / reaction,
+//every other field has exactly one value per report (empty when it is absent)
+struct field_spec{
+    std::string name;
+    std::string path;
+    //lowercased and trimmed with normalize_ascii
+    bool normalize = false;
+};
+
+//declarative list of the fields the extraction stage has to produce,
+//every element which is not on the path of one of them is skipped unread
+class field_list{
+public:
+    //short names of the usual fields (patientsex -> patient/patientsex ...),
+    //any other name is taken as a path relative to <safetyreport>
+    static field_spec lookup(std::string_view name);
+    static bool is_known(std::string_view name);
+
+    //adds the field if it is not already in the list and returns its index
+    std::size_t add(std::string_view name);
+    std::optional<std::size_t> index_of(std::string_view name) const;
+
+    inline std::size_t size() const{
+        return fields_.size();
+    }
+
+    inline const field_spec& operator[](std::size_t i) const{
+        return fields_[i];
+    }
+
+private:
+    std::vector<field_spec> fields_;
+};
+
+//values of every field of a field_list for one <safetyreport>, values[i] belongs to field i.
+//flags[i][k] is what normalize_ascii found in values[i][k] (nothing for the fields
+//which are not normalized), so that the text is not scanned again
+struct report_record{
+    std::vector<std::vector<std::string>> values;
+    std::vector<std::vector<text_flags>> flags;
+};
+
+//one --where expression : receivedate>=20240101, serious=1, occurcountry in (US,FR)
+//values are compared as numbers when both sides are numbers, as strings otherwise
+struct field_condition{
+    enum class op{eq, ne, lt, le, gt, ge, in};
+
+    std::size_t field;
+    op operation;
+    std::vector<std::string> values;
+
+    bool test(std::string_view value) const;
+};
+
+//conjunction of --where expressions, evaluated by the report_reader while it
+//streams a report. A condition on a per drug (per reaction) field only keeps the
+//drugs (reactions) satisfying it, the report is dropped when none is left
+class report_filter{
+public:
+    //parse an expression and add its field to the extracted fields, false if malformed
+    bool add(std::string_view expression, field_list& fields);
+
+    inline bool empty() const{
+        return conditions_.empty();
+    }
+
+    inline const std::vector<field_condition>& conditions() const{
+        return conditions_;
+    }
+
+private:
+    std::vector<field_condition> conditions_;
+};
+
+//streaming reader over an ichicsr XML file, returns one <safetyreport> at a time.
+//Only the elements leading to a requested field are tokenized, the other
+//subtrees (narratives, sender, dosage text ...) are skipped by scanning for
+//their closing tag without decoding or storing their content.
+//The conditions of the filter on header fields (direct children of <safetyreport>)
+//are checked as soon as these fields have been read, a rejected report is
+//skipped like any other unwanted subtree and never returned by next()
+class report_reader{
+public:
+    report_reader(const std::string& path, const field_list& fields,
+                  const report_filter& filter = {});
+
+    inline bool is_open() const{
+        return ist_.is_open();
+    }
+
+    //fills record with the next report, false when the file is exhausted
+    bool next(report_record& record);
+
+    //number of reports rejected by the filter so far
+    inline std::size_t rejected() const{
+        return rejected_;
+    }
+
+private:
+    enum class tag_kind{start, end, empty, text, other, eof};
+
+    //name points into the buffer, it is only valid until the next read
+    struct tag{
+        tag_kind kind = tag_kind::eof;
+        std::string_view name;
+    };
+
+    struct node{
+        std::map<std::string, std::size_t, std::less<>> children;
+        std::optional<std::size_t> field;
+        //fields whose values are aligned on the occurrences of this element
+        std::vector<std::size_t> group_fields;
+        //conditions on these fields
+        std::vector<const field_condition*> conditions;
+    };
+
+    bool refill();
+    std::size_t find(char c, std::size_t offset = 0);
+    std::size_t find(std::string_view s, std::size_t offset = 0);
+    std::size_t find_tag_end(std::size_t offset);
+    bool starts_with(std::string_view s);
+
+    void read_text(std::string* text);
+    tag read_tag(std::string* text);
+    void skip_subtree();
+
+    void open_element(std::size_t n, report_record& record);
+    void close_element(std::size_t n, std::string& text, report_record& record);
+    void read_element(std::size_t n, report_record& record);
+    bool header_ready(const report_record& record, std::string_view next_tag) const;
+    bool check(const std::vector<const field_condition*>& conditions,
+               const report_record& record) const;
+
+    std::ifstream ist_;
+    std::vector<char> buffer_;
+    std::size_t begin_ = 0;
+    std::size_t end_ = 0;
+
+    const field_list& fields_;
+    std::vector<node> nodes_; //nodes_[0] is <safetyreport>
+    std::vector<std::size_t> group_start_;
+
+    std::vector<field_condition> conditions_;
+    std::vector<const field_condition*> header_conditions_;
+    std::vector<std::size_t> filtered_groups_;
+    bool header_checked_ = false;
+    bool report_rejected_ = false;
+    std::size_t rejected_ = 0;
+};
+
+#endif
@@ -1,18 +1,35 @@
 #include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <memory>
 #include <numeric>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <cctype>
 #include <sstream>
-#include <format>
 #include <regex>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <mutex>
+#include <climits>
+#include <filesystem>
 #include <getopt.h>
-#include "pugixml.hpp"
+#include "perfect_hash.hpp"
+#include "atc_tables.hpp"
+#include "faers_reader.hpp"
+#include "rds_writer.hpp"
+#include "bounded_queue.hpp"
+#include "normalize.hpp"
+#include "atc_csv.hpp"
+#include "space_saving.hpp"
 
 using string_list = std::vector<std::vector<std::string>>;
 
@@ -60,18 +77,39 @@ public:
         ATC_code_list_ = ATC_code_list;
     };
 
-    inline std::vector<std::string> get_substance_list() const{
+    inline void set_fields(const std::vector<std::string>& fields){
+        fields_ = fields;
+    };
+
+    inline void set_drug_delimiters(std::vector<bool> drug_delimiters){
+        drug_delimiters_ = std::move(drug_delimiters);
+    };
+
+    //whether drug i of the substance list has one of the delimiters of apply_correction_drug
+    inline bool drug_has_delimiter(std::size_t i) const{
+        return i < drug_delimiters_.size() && drug_delimiters_[i];
+    }
+
+    inline const std::string& get_id() const{
+        return id_;
+    }
+
+    inline const std::vector<std::string>& get_substance_list() const{
         return substance_list_;
     }
 
-    inline std::vector<std::string> get_AE_list() const{
+    inline const std::vector<std::string>& get_AE_list() const{
         return AE_list_;
     }
 
-    inline std::set<int> get_code_list() const{
+    inline const std::set<int>& get_code_list() const{
         return ATC_code_list_;
     }
 
+    inline const std::vector<std::string>& get_fields() const{
+        return fields_;
+    }
+
     inline void print_code(std::ostream& ofs) const {
         std::string result;
         for (auto it = ATC_code_list_.begin(); it != ATC_code_list_.end(); ++it) {
@@ -95,13 +133,22 @@ public:
             ofs << sub << ' ';
     }
 
-    void export_csv(std::ofstream& ofs) const;
+    inline void print_fields(std::ostream& ofs) const{
+        for(auto& field : fields_)
+            ofs << field << ';';
+    }
+
+    void export_csv(std::ostream& ofs) const;
 
 private:
     std::string id_;
     std::vector<std::string> substance_list_;
     std::vector<std::string> AE_list_;
     std::set<int> ATC_code_list_;
+    //values of the extra fields requested with --fields
+    std::vector<std::string> fields_;
+    //text_flags::has_delimiter of each drug, as found while the XML was parsed
+    std::vector<bool> drug_delimiters_;
 };
 
 patient::patient(const std::string& id, const std::vector<std::string>& substance_list,
@@ -114,78 +161,48 @@ patient::patient(const std::string& id, const std::string& code_ATC,
             AE_list_{string_to_vector(AE_list)}
             {}
 
-void patient::export_csv(std::ofstream& ofs) const{
+void patient::export_csv(std::ostream& ofs) const{
     print_code(ofs);
     ofs << ";";
     print_AE(ofs);
     ofs << ";";
     print_substance(ofs);
     ofs<<";";
+    print_fields(ofs);
 }
 
+//indices in the field_list of the fields a patient is built from
+struct patient_fields{
+    std::size_t id;
+    std::size_t drug;
+    std::size_t AE;
+    std::vector<std::size_t> extra;
+};
 
-bool load_xml_file(const std::string& path, pugi::xml_document& doc){
-    
-    pugi::xml_parse_result result = doc.load_file(path.c_str());
-
-    if(!result){
-        std::cout << "Error parsing the xml file.\n";
-        return false;
-    }
-    return true;
-
-}
-
-//for each patient return a drug set in the form drug1;drug2; ... 
-std::map<std::string,std::string> patient_drugs(const pugi::xpath_node_set& patientNodes,
-                                       const std::vector<std::string>& id_list){
-
-    std::map<std::string,std::string> returned_map;
-    
-    int i = 0;
-    for(pugi::xpath_node patient : patientNodes){
-
-        //recuperer les médicaments pris par le patient
-        auto drugs = patient.node().children("drug");
-        std::string drug_set = "";
-        std::string d_name ="";
-        
-        std::string id = id_list[i++];
-        for (const auto& drug : drugs){
-            d_name = drug.child("medicinalproduct").child_value();
-            std::transform(d_name.cbegin(), d_name.cend(), d_name.begin(),
-                                            [](unsigned char c){ return std::tolower(c);});
-            drug_set.append(d_name + ";");
-        }
-        returned_map.insert_or_assign(id,drug_set);
-    }
-    return returned_map;
-}
-
-//for each patient return an adverse event set in the form {AE1, AE2, ... , AEn}
-std::map<std::string, std::vector<std::string>> patient_adverse_events(const pugi::xpath_node_set& patientNodes,
-                                    const std::vector<std::string>& id_list){
-    std::map<std::string, std::vector<std::string>> returned_set;
-    
-    std::vector<std::string> patient_AE;
-    int i = 0;
-    for(pugi::xpath_node patient : patientNodes){
-        std::string AE_name = "";
-        std::string id = id_list[i++];
-        //catch all reaction for each patients
-        auto AEs = patient.node().children("reaction");
-        for (const auto& AE : AEs){
-            //here we may want to lower case the PT term ? can do it post
-            std::string tm = AE.child("reactionmeddrapt").child_value();
-            std::transform(tm.begin(), tm.end(), tm.begin(),
-                    [](unsigned char c){ return std::tolower(c); });
-            
-            patient_AE.push_back(tm);            
-        }
-        returned_set.insert_or_assign(id,patient_AE);
-        patient_AE.clear();
+//a patient from a report streamed out of the XML : its drugs, its reactions and the
+//values of the extra fields (comma separated when the field has a value per drug or per reaction).
+//Patients keep the file order and a repeated safetyreportid gives one patient per report
+patient patient_from_record(const report_record& record, const patient_fields& fields){
+    patient pat(record.values[fields.id].front(), record.values[fields.drug], record.values[fields.AE]);
+    std::vector<bool> drug_delimiters;
+    drug_delimiters.reserve(record.flags[fields.drug].size());
+    for(const auto& flags : record.flags[fields.drug])
+        drug_delimiters.push_back(flags.has_delimiter);
+    pat.set_drug_delimiters(std::move(drug_delimiters));
+    if(fields.extra.empty())
+        return pat;
+
+    std::vector<std::string> extra_values;
+    extra_values.reserve(fields.extra.size());
+    for(auto f : fields.extra){
+        const auto& values = record.values[f];
+        std::string joined;
+        for(std::size_t i = 0; i < values.size(); ++i)
+            joined += (i == 0 ? "" : ",") + values[i];
+        extra_values.push_back(std::move(joined));
     }
-    return returned_set;
+    pat.set_fields(extra_values);
+    return pat;
 }
 
 
@@ -217,6 +234,8 @@ std::map<std::string,std::string> get_standardized_substance(std::ifstream& ist)
         if((pos = line.find(quote)) != std::string::npos){
             line = line.substr(pos + quote.length(), line.find(quote,pos+quote.length())-1);
         }
+        normalize_ascii(drug);
+        normalize_ascii(line);
         returned_map.insert({drug,line});
     }
 
@@ -224,155 +243,37 @@ std::map<std::string,std::string> get_standardized_substance(std::ifstream& ist)
 
 }
 
-std::map<std::string,std::string> get_atc_from_standardized(std::string_view path){
-    std::map<std::string,std::string> returned_map;
-    
-    std::ifstream ist(path);
-    if(!ist.is_open()){
-        std::cerr << "Error opening the ATC binder file.\n";
-        return returned_map;
-    }
-
-    std::string header;
-    std::getline(ist, header);
-
-    std::string delimiter = ";";
-    int pos;
-    std::string substance;
-    std::vector<std::string> current_row;
+//ATC tree index and substance -> ATC code lookups. They are answered by the
+//tables compiled in at build time (tools/embed_tables.cpp) unless a CSV
+//has been loaded at runtime with --atc-tree or --atc-binder
+class atc_tables{
+public:
+    bool load_tree(std::string_view path);
+    bool load_binder(std::string_view path);
 
-    for(std::string line; std::getline(ist, line); ){
-        while ((pos = line.find(delimiter)) != std::string::npos) {
-            current_row.push_back(line.substr(0, pos));
-            line.erase(0, pos + delimiter.length());
-        }
-        //we are interested in the susbtance name + ATC primary code so index 1 and 3 of the csv file
-        returned_map.insert({current_row[1],current_row[3]});
-        current_row.clear();
+    bool has_binder() const{
+        return binder_override_ || !embedded_atc::binder_keys.empty();
     }
 
+    std::optional<uint16_t> index_of(std::string_view code) const;
+    std::optional<std::string_view> code_of(std::string_view substance) const;
+    //reverse of index_of, a linear scan only meant for the few codes of a report
+    std::optional<std::string_view> code_at(uint16_t index) const;
 
-    return returned_map;
-}
-
-std::map<std::string,std::vector<std::string>> extract_drugs_from_raw(const std::map<std::string,std::string>& raw_drugs){
-    std::string delim = ";";
-    std::map<std::string,std::vector<std::string>> patients_drugs_list;
-
-    std::string current_drug = "";
-    std::vector<std::string> drugs_list;
-    for(auto [k,v] : raw_drugs){
-        size_t pos = 0;
-        //separe each drug
-        while((pos = v.find(delim)) != std::string::npos){
-            current_drug = v.substr(0,pos);
-            v.erase(0, pos + delim.length());
-            drugs_list.push_back(current_drug);
-        }
-        patients_drugs_list.emplace(k,drugs_list);
-        drugs_list.clear();
-    }
-    return patients_drugs_list;
-}
+private:
+    std::optional<atc_index_map> tree_override_;
+    std::optional<atc_binder_map> binder_override_;
+};
 
 //apply a correction to a drug, in order to find a match in the drug-substances dictionnary
-//we lemmatize the drug in parameter.
-std::string apply_correction_drug(const std::string& drug){
+//we lemmatize the drug in parameter. The drug is already normalized by the reader,
+//has_delimiter comes from that pass so the drug is not scanned again
+std::string apply_correction_drug(const std::string& drug, bool has_delimiter){
     // we should be able to catch ~90% of uncorrect words
-    std::string corrected_drug = drug;
     //if the delimiter is in the string, correct it
-    if(drug.find_first_of("/([{^") != std::string::npos){
-        corrected_drug = drug.substr(0,drug.find(" "));
-    }
-    return corrected_drug;
-}
-
-//some substances have an extra space at the end of the substances which 
-//falsify every comparaison with atc tree, 1st idea -> erase this space
-//2nd idea, some substances are represented with '-', int the ATC tree 
-//there are no - , we then remove it
-std::string apply_correction_substances(const std::string& substance){
-    std::string corrected_substance = substance;
-    if(substance.ends_with("\r") ){
-        corrected_substance = substance.substr(0,substance.length()-1);
-    }
-    
-    /*auto pos = corrected_substance.find("-");
-    if(pos != std::string::npos){
-        corrected_substance.erase(std::remove(corrected_substance.begin(),
-                                              corrected_substance.end(),'-'),
-                                  corrected_substance.end());        
-    }*/
-    //if(corrected_substance.ends_with(",") || corrected_substance.ends_with(","))
-    return corrected_substance;
-}
-
-void get_patients_substances(
-    const std::map<std::string,std::string>& standardized_dic,
-    std::vector<patient>& patient_list)
-    {
-    string_list all_patients_substances;
-    all_patients_substances.reserve(patient_list.size());
-    
-    std::string delimiter = ";";
-    std::string current_drug = "";
-    std::string substances = "";
-    std::string current_sub;
-    int err_catch = 0 ;
-    std::vector<std::string> patient_substances;
-    
-    for(auto& patient : patient_list){
-        //for each patients drugs
-        for(auto drug : patient.get_substance_list()){
-            try{
-                //we apply basic drug correction in order to find a matching in the map
-                substances = standardized_dic.at(apply_correction_drug(drug));
-                substances = apply_correction_substances(substances); 
-            }
-            catch(const std::out_of_range& oor){
-                substances = "NA";
-            }
-            int pos = substances.find(delimiter);
-            while(pos != std::string::npos){
-                current_sub = substances.substr(0,pos);
-                substances.erase(0,pos + delimiter.length());
-                patient_substances.push_back(current_sub);
-                pos = substances.find(delimiter);
-            }
-            //add the last substances
-            patient_substances.push_back(substances);
-        }
-        patient.set_substance_list(patient_substances);
-        patient_substances.clear();
-    }
-}
-
-std::vector<patient> delete_NA_substances(const std::vector<patient>& patients_list){
-    std::vector<patient> returned_patients;
-    returned_patients.reserve(patients_list.size());
-
-    for(const auto& pat : patients_list){
-        auto subs = pat.get_substance_list();
-        if(std::count(subs.begin(), subs.end(), "NA") == 0){
-            returned_patients.push_back(pat);
-        }
-    }
-    returned_patients.shrink_to_fit();
-    return returned_patients;
-}
-
-std::vector<patient> delete_NA_code(const std::vector<patient>& patients_list){
-    std::vector<patient> returned_patients;
-    returned_patients.reserve(patients_list.size());
-
-    for(const auto& pat : patients_list){
-        auto codes = pat.get_code_list();
-        if(std::count(codes.begin(), codes.end(), INT_MIN) == 0){
-            returned_patients.push_back(pat);
-        }
-    }
-    returned_patients.shrink_to_fit();
-    return returned_patients;
+    if(has_delimiter)
+        return drug.substr(0,drug.find(" "));
+    return drug;
 }
 
 std::map<std::string, int> get_atc_code(std::ifstream& ist){
@@ -398,69 +299,6 @@ std::map<std::string, int> get_atc_code(std::ifstream& ist){
 
     return atc_codes;
 }
-//convert substances to ATC code to allow data to be processed by the algorithm
-std::vector<std::vector<int>> get_ATC_code_from_substances(const string_list& substances_lists,
-                                                           const std::vector<std::string>& ATC_sub){
-    std::vector<std::vector<int>> ATC_patients;
-    ATC_patients.reserve(substances_lists.size());
-
-    std::vector<int> patient;
-    for(const auto& list : substances_lists){
-        for(const auto& substances : list){
-            //get the index of each substances i the ATC tree
-            auto i = std::find(ATC_sub.begin(), ATC_sub.end(), substances);
-            //if the substance has not been found, we add INT_MIN to mark the substances
-            int index = i == ATC_sub.end() ? INT_MIN : std::distance(std::begin(ATC_sub), i);
-            patient.push_back(index);
-        }
-        ATC_patients.push_back(patient);
-        patient.clear();
-    }
-    return ATC_patients;
-}
-
-//convert substances to ATC code to allow data to be processed by the algorithm
-void get_ATC_code_from_substances(std::vector<patient>& patients,
-                                  const std::map<std::string,std::string>& map_ATC){
-    std::vector<patient> ATC_patients;
-    ATC_patients.reserve(patients.size());
-
-    std::vector<std::string> patient;
-    for(auto& pat : patients){
-        for(const auto& substances : pat.get_substance_list()){
-            try{
-                patient.push_back(map_ATC.at(substances));
-            }catch(const std::out_of_range& oor){
-                patient.push_back("NA");
-            }
-        }
-        pat.set_substance_list(patient);
-        patient.clear();
-    }
-}
-
-void get_index_from_ATC_code(std::vector<patient>& patients,
-                                                      const std::map<std::string,uint16_t>& map_ATC_index){
-    std::vector<patient> returned_pat;
-    returned_pat.reserve(patients.size());
-
-    std::set<int> patient_code;
-    int cd;
-
-    for(auto& patient : patients){
-        for(const auto& code : patient.get_substance_list()){
-            try{
-                cd = map_ATC_index.at(code);
-            }catch(const std::out_of_range& oor){
-                cd = INT_MIN;
-            }
-            patient_code.insert(cd);
-        }
-        patient.set_ATC_code_list(patient_code);
-        patient_code.clear();
-    }
-}
-
 std::map<std::string,std::string> get_atc_tree(std::ifstream& ist){
     std::map<std::string,std::string> atc_line;
     if(!ist.is_open()){
@@ -501,69 +339,124 @@ std::map<std::string, uint32_t> get_number_of_AE_per_AE(const string_list& patie
     return AE_count;
 }
 
-std::map<std::string, uint16_t> get_atc_tree_index(std::ifstream& ist){
-    std::map<std::string, uint16_t> atc_line;
-    uint16_t ATC_index= 0;
-    if(!ist.is_open()){
-        std::cout << "Error opening the ATC tree file ATC_tree.csv\n";
-        return atc_line;
+bool atc_tables::load_tree(std::string_view path){
+    std::ifstream ist_tree{std::string(path)};
+    if(!ist_tree.is_open()){
+        std::cerr << "Error opening the ATC tree file " << path << "\n";
+        return false;
     }
-
-    //get the header of the CSV file
-    std::string header;
-    std::getline(ist, header);
-
-    std::string ATC_code;
-    std::string sep = ",";
-    int pos;
-    //second columns of the csv file
-    for(std::string line; std::getline(ist, line); ){
-        pos = line.find(sep);
-        ATC_code = line.substr(0,pos);
-        atc_line.insert({ATC_code, ATC_index++});
+    tree_override_ = get_atc_tree_index(ist_tree);
+    if(tree_override_->empty()){
+        std::cerr << "Error: no ATC code read from the ATC tree file " << path << "\n";
+        return false;
     }
-
-    return atc_line;
+    return true;
 }
 
-void export_patients(const std::vector<patient>& clean_patients_list, std::string_view out_path){
-    std::ofstream ofs(out_path);
-    if(!ofs.is_open()){
-        std::cout << "Error opening: " << out_path <<  "\n";
-        return;
+bool atc_tables::load_binder(std::string_view path){
+    std::ifstream ist_binder{std::string(path)};
+    if(!ist_binder.is_open()){
+        std::cerr << "Error opening the ATC binder file " << path << "\n";
+        return false;
     }
-    ofs << "CODE ; AE ; SUBSTANCES \n";
-    for(const auto& pat : clean_patients_list){
-        pat.export_csv(ofs);
-        ofs<<'\n';
+    binder_override_ = get_atc_from_standardized(ist_binder);
+    if(binder_override_->empty()){
+        std::cerr << "Error: no substance read from the ATC binder file " << path << "\n";
+        return false;
     }
+    return true;
+}
 
-    ofs.close();
+std::optional<uint16_t> atc_tables::index_of(std::string_view code) const{
+    if(tree_override_){
+        auto it = tree_override_->find(code);
+        return it == tree_override_->end() ? std::nullopt : std::optional<uint16_t>{it->second};
+    }
+    auto pos = perfect_hash_find(code, embedded_atc::tree_keys,
+                                 embedded_atc::tree_seeds, embedded_atc::tree_slots);
+    if(pos == embedded_atc::tree_keys.size())
+        return std::nullopt;
+    return embedded_atc::tree_index[pos];
 }
 
-void export_code_with_AE(const std::vector<patient>& clean_patients_list,
-                             const std::vector<bool>& AE, std::string_view out_path){
-    std::ofstream ofs(out_path);
-    if(!ofs.is_open()){
-        std::cout << "Error opening: " << out_path <<  "\n";
-        return;
+std::optional<std::string_view> atc_tables::code_of(std::string_view substance) const{
+    if(binder_override_){
+        auto it = binder_override_->find(substance);
+        return it == binder_override_->end() ? std::nullopt : std::optional<std::string_view>{it->second};
     }
-    ofs << "patientATC ; patientADR \n";
-    for(int i = 0 ; i < clean_patients_list.size(); ++i){
-        clean_patients_list[i].print_code(ofs);
-        if(AE[i])
-            ofs << ";1\n";
-        else
-            ofs << ";0\n";
+    auto pos = perfect_hash_find(substance, embedded_atc::binder_keys,
+                                 embedded_atc::binder_seeds, embedded_atc::binder_slots);
+    if(pos == embedded_atc::binder_keys.size())
+        return std::nullopt;
+    return embedded_atc::binder_codes[pos];
+}
+
+std::optional<std::string_view> atc_tables::code_at(uint16_t index) const{
+    if(tree_override_){
+        for(const auto& [code, i] : *tree_override_)
+            if(i == index)
+                return code;
+        return std::nullopt;
     }
+    for(std::size_t pos = 0; pos < embedded_atc::tree_keys.size(); ++pos)
+        if(embedded_atc::tree_index[pos] == index)
+            return embedded_atc::tree_keys[pos];
+    return std::nullopt;
+}
+
+void write_patients_header(std::ostream& ofs, const std::vector<std::string>& field_names){
+    ofs << "CODE ; AE ; SUBSTANCES ";
+    for(const auto& name : field_names)
+        ofs << "; " << name << ' ';
+    ofs << "\n";
+}
 
-    ofs.close();
+void write_code_with_AE(std::ostream& ofs, const patient& pat, bool AE){
+    pat.print_code(ofs);
+    if(AE)
+        ofs << ";1\n";
+    else
+        ofs << ";0\n";
 }
 
+//outputs whose name ends with .rds are written in R's serialization format
+bool is_rds_path(std::string_view path){
+    return path.ends_with(".rds");
+}
+
+//.rds version of the patients csv (with_ADR false) : patientATC, patientAE and
+//patientSubstances list columns then one character column per extra field, or of
+//the code csv (with_ADR true) : patientATC and a logical patientADR
+rds_data_frame_writer open_patients_rds(const std::string& path, bool with_ADR,
+                                        const std::vector<std::string>& field_names){
+    using column = rds_data_frame_writer::column;
+    if(with_ADR)
+        return {path, {"patientATC", "patientADR"}, {column::integer_list, column::logical}};
+    std::vector<std::string> names = {"patientATC", "patientAE", "patientSubstances"};
+    names.insert(names.end(), field_names.begin(), field_names.end());
+    std::vector<column> columns = {column::integer_list, column::string_list, column::string_list};
+    columns.insert(columns.end(), field_names.size(), column::string);
+    return {path, names, columns};
+}
+
+void write_patient_rds(rds_data_frame_writer& rds, const patient& pat, bool with_ADR, bool ADR){
+    const auto& code_list = pat.get_code_list();
+    std::vector<int> codes(code_list.begin(), code_list.end());
+    rds.write_integer_list(0, codes);
+    if(with_ADR){
+        rds.write_logical(1, ADR);
+    }else{
+        rds.write_string_list(1, pat.get_AE_list());
+        rds.write_string_list(2, pat.get_substance_list());
+        for(std::size_t i = 0; i < pat.get_fields().size(); ++i)
+            rds.write_string(3 + i, pat.get_fields()[i]);
+    }
+    rds.end_row();
+}
 
 std::vector<patient> read_patients_csv(std::string_view in_path){
     std::vector<patient> returned_pat;
-    std::ifstream ist(in_path);
+    std::ifstream ist{std::string(in_path)};
     if(!ist.is_open()){
         std::cerr << "Error opening the patients csv file: "<< in_path << "\n";
         return returned_pat;
@@ -593,10 +486,8 @@ std::vector<patient> read_patients_csv(std::string_view in_path){
 std::vector<bool> get_AE_boolean(const string_list& patients_PT_code, std::string_view desired_PT){
     std::vector<bool> AE_true;
     AE_true.reserve(patients_PT_code.size());
-    std::string desired_PT_lower = desired_PT.data();
-    std::transform(desired_PT_lower.begin(), desired_PT_lower.end(),
-                     desired_PT_lower.begin(),
-                    [](unsigned char c){ return std::tolower(c); });
+    std::string desired_PT_lower{desired_PT};
+    normalize_ascii(desired_PT_lower);
     
     for(const auto& patients : patients_PT_code){
         AE_true.push_back(std::find(patients.begin(), patients.end(), desired_PT_lower) != patients.end()
@@ -692,6 +583,737 @@ void process_csv_standardized_drugnames(const std::string& inputFileName, const
     outputFile.close();
 }
 
+//memoized drug -> substances -> ATC code -> ATC tree index chain, the only place
+//drugs are mapped. Each distinct drug name is resolved once, every other occurrence
+//costs one hash lookup, misses included. Each worker owns its resolver, so there is no locking
+class drug_resolver{
+public:
+    //how far the resolution went, a patient is removed at the first step one of its drugs fails
+    enum class stage{no_substance, no_ATC_code, no_ATC_index, resolved};
+
+    struct resolution{
+        stage reached = stage::resolved;
+        std::vector<std::string> codes;
+        std::vector<int> indices;
+    };
+
+    drug_resolver(const std::map<std::string,std::string>& standardized_dic, const atc_tables& tables)
+        : standardized_dic_{standardized_dic}, tables_{tables}{}
+
+    //has_delimiter is the flag normalize_ascii gave for this drug
+    const resolution& resolve(const std::string& drug, bool has_delimiter){
+        auto it = cache_.find(drug);
+        if(it == cache_.end())
+            it = cache_.emplace(drug, compute(drug, has_delimiter)).first;
+        return it->second;
+    }
+
+private:
+    resolution compute(const std::string& drug, bool has_delimiter) const;
+
+    const std::map<std::string,std::string>& standardized_dic_;
+    const atc_tables& tables_;
+    std::unordered_map<std::string, resolution> cache_;
+};
+
+drug_resolver::resolution drug_resolver::compute(const std::string& drug, bool has_delimiter) const{
+    resolution r;
+    auto found = standardized_dic_.find(apply_correction_drug(drug, has_delimiter));
+    if(found == standardized_dic_.end()){
+        r.reached = stage::no_substance;
+        return r;
+    }
+
+    //the substances of the mapping are normalized when it is loaded (get_standardized_substance)
+    std::string_view substances = found->second;
+    while(true){
+        std::size_t pos = substances.find(';');
+        auto code = tables_.code_of(substances.substr(0, pos));
+        if(code)
+            r.codes.emplace_back(*code);
+        else
+            r.reached = std::min(r.reached, stage::no_ATC_code);
+        if(pos == std::string_view::npos)
+            break;
+        substances.remove_prefix(pos + 1);
+    }
+
+    for(const auto& code : r.codes){
+        auto index = tables_.index_of(code);
+        if(index)
+            r.indices.push_back(*index);
+        else
+            r.reached = std::min(r.reached, stage::no_ATC_index);
+    }
+    return r;
+}
+
+//--sample : Bernoulli (a rate) or reservoir (a fixed size) sampling of the reports
+//while they are parsed, so that the reports left out are never mapped. When
+//stratified, the patients having the --specific AE and the others are sampled
+//separately, each stratum with its own rate or size
+class report_sampler{
+public:
+    //"5%" or "0.05" is a rate, "20000" a reservoir size, "100%,5%" gives one per stratum
+    bool parse(std::string_view spec, uint64_t seed);
+
+    inline bool stratified() const{
+        return strata_.size() == 2;
+    }
+
+    //true when the patient goes on right away (kept by a rate), false when it
+    //is dropped or kept in a reservoir until the end of the input
+    bool offer(patient& pat, bool has_AE);
+
+    //the reservoir samples, in input order
+    std::vector<patient> drain();
+
+    inline std::size_t sampled() const{
+        return sampled_;
+    }
+
+private:
+    struct stratum{
+        double rate = 0;
+        std::size_t size = 0; //reservoir size, 0 for a rate
+        std::size_t seen = 0;
+        std::vector<std::pair<std::size_t, patient>> reservoir;
+    };
+
+    std::vector<stratum> strata_;
+    std::mt19937_64 engine_;
+    std::size_t position_ = 0;
+    std::size_t sampled_ = 0;
+};
+
+bool report_sampler::parse(std::string_view spec, uint64_t seed){
+    engine_.seed(seed);
+    strata_.clear();
+    for(const auto& token : string_to_vector(std::string(spec))){
+        stratum st;
+        //stoul would wrap a negative size
+        if(token.starts_with('-'))
+            return false;
+        try{
+            std::size_t end;
+            if(token.ends_with('%')){
+                st.rate = std::stod(token, &end) / 100;
+                ++end;
+            }else if(token.find('.') != std::string::npos){
+                st.rate = std::stod(token, &end);
+            }else{
+                st.size = std::stoul(token, &end);
+            }
+            if(end != token.size() || (st.size == 0 && !(st.rate > 0 && st.rate <= 1)))
+                return false;
+        }catch(const std::exception&){
+            return false;
+        }
+        st.reservoir.reserve(st.size);
+        strata_.push_back(std::move(st));
+    }
+    return strata_.size() == 1 || strata_.size() == 2;
+}
+
+bool report_sampler::offer(patient& pat, bool has_AE){
+    stratum& st = strata_[stratified() && !has_AE ? 1 : 0];
+    std::size_t position = position_++;
+    std::size_t seen = st.seen++;
+
+    if(st.size == 0){
+        bool kept = std::uniform_real_distribution<double>(0, 1)(engine_) < st.rate;
+        sampled_ += kept;
+        return kept;
+    }
+    //reservoir (algorithm R) : the n-th patient replaces a random sample with probability size/n
+    if(st.reservoir.size() < st.size){
+        st.reservoir.emplace_back(position, std::move(pat));
+        ++sampled_;
+    }else{
+        std::size_t j = std::uniform_int_distribution<std::size_t>(0, seen)(engine_);
+        if(j < st.size)
+            st.reservoir[j] = {position, std::move(pat)};
+    }
+    return false;
+}
+
+std::vector<patient> report_sampler::drain(){
+    std::vector<std::pair<std::size_t, patient>> samples;
+    for(auto& st : strata_){
+        std::move(st.reservoir.begin(), st.reservoir.end(), std::back_inserter(samples));
+        st.reservoir.clear();
+    }
+    std::sort(samples.begin(), samples.end(),
+              [](const auto& a, const auto& b){ return a.first < b.first; });
+
+    std::vector<patient> returned_patients;
+    returned_patients.reserve(samples.size());
+    for(auto& [position, pat] : samples)
+        returned_patients.push_back(std::move(pat));
+    return returned_patients;
+}
+
+bool patient_has_AE(const patient& pat, const std::regex& desired_PT_regex){
+    const auto& AEs = pat.get_AE_list();
+    return std::any_of(AEs.begin(), AEs.end(),
+                       [&](const std::string& AE){ return std::regex_search(AE, desired_PT_regex); });
+}
+
+//a batch of consecutive reports going through the pipeline, sequence gives the input order
+struct patient_batch{
+    std::size_t sequence = 0;
+    std::vector<patient> patients;
+    std::vector<bool> ADR;
+};
+
+struct pipeline_options{
+    //the parser and the writer have their own thread
+    std::size_t threads = std::max(3u, std::thread::hardware_concurrency()) - 2;
+    std::size_t batch_size = 1024;
+    std::size_t queue_depth = 16;
+};
+
+//patients left after each step of the mapping, summed over the batches for --verbose
+struct pipeline_counters{
+    std::atomic<std::size_t> read{0};
+    std::atomic<std::size_t> substances{0};
+    std::atomic<std::size_t> ATC_code{0};
+    std::atomic<std::size_t> ATC_index{0};
+};
+
+//drug -> substances -> ATC code -> ATC tree index on a batch, patients with
+//an unknown drug, substance or code are removed. The AE boolean is computed
+//when a regex is given
+void map_patient_batch(patient_batch& batch, drug_resolver& resolver,
+                       const std::regex* AE_reg, pipeline_counters& counters){
+    using stage = drug_resolver::stage;
+    std::size_t kept = 0, substances = 0, ATC_code = 0;
+    std::vector<std::string> codes;
+    std::set<int> indices;
+
+    for(auto& pat : batch.patients){
+        stage reached = stage::resolved;
+        const auto& drugs = pat.get_substance_list();
+        for(std::size_t i = 0; i < drugs.size(); ++i){
+            const auto& r = resolver.resolve(drugs[i], pat.drug_has_delimiter(i));
+            reached = std::min(reached, r.reached);
+            codes.insert(codes.end(), r.codes.begin(), r.codes.end());
+            indices.insert(r.indices.begin(), r.indices.end());
+        }
+        substances += reached > stage::no_substance;
+        ATC_code += reached > stage::no_ATC_code;
+
+        if(reached == stage::resolved){
+            pat.set_substance_list(codes);
+            pat.set_ATC_code_list(indices);
+            if(&batch.patients[kept] != &pat)
+                batch.patients[kept] = std::move(pat);
+            ++kept;
+        }
+        codes.clear();
+        indices.clear();
+    }
+
+    counters.read += batch.patients.size();
+    counters.substances += substances;
+    counters.ATC_code += ATC_code;
+    counters.ATC_index += kept;
+    batch.patients.erase(batch.patients.begin() + kept, batch.patients.end());
+
+    if(AE_reg)
+        batch.ADR = get_AE_boolean_regex(AE_string_list_from_patient_vector(batch.patients), *AE_reg);
+}
+
+struct ATC_PT_hash{
+    std::size_t operator()(const std::pair<int, std::string>& pair) const{
+        return std::hash<std::string>{}(pair.second) * 31 + pair.first;
+    }
+};
+
+//--topk : heavy hitter sketches of the ATC indices, PTs and ATC - PT pairs of the
+//mapped reports. Each key is counted once per report. Every worker fills its own
+//sketches, they are merged at the end so the memory stays 3 * capacity counters per worker
+struct topk_sketches{
+    explicit topk_sketches(std::size_t capacity) : ATC{capacity}, PT{capacity}, ATC_PT{capacity}{}
+
+    void add(const patient& pat){
+        PTs_.assign(pat.get_AE_list().begin(), pat.get_AE_list().end());
+        std::sort(PTs_.begin(), PTs_.end());
+        PTs_.erase(std::unique(PTs_.begin(), PTs_.end()), PTs_.end());
+        std::erase(PTs_, std::string{});
+
+        for(int index : pat.get_code_list()){
+            ATC.add(index);
+            for(const auto& PT_name : PTs_)
+                ATC_PT.add({index, PT_name});
+        }
+        for(const auto& PT_name : PTs_)
+            PT.add(PT_name);
+    }
+
+    void merge(const topk_sketches& other){
+        ATC.merge(other.ATC);
+        PT.merge(other.PT);
+        ATC_PT.merge(other.ATC_PT);
+    }
+
+    space_saving<int> ATC;
+    space_saving<std::string> PT;
+    space_saving<std::pair<int, std::string>, ATC_PT_hash> ATC_PT;
+
+private:
+    std::vector<std::string> PTs_;
+};
+
+//one line of the --topk output, ATC is INT_MIN (NA) on the PT lines
+struct topk_row{
+    std::string type;
+    int ATC = INT_MIN;
+    std::string ATC_code;
+    std::string PT;
+    uint64_t count;
+    uint64_t error;
+};
+
+std::vector<topk_row> topk_rows(const topk_sketches& sketches, std::size_t k, const atc_tables& tables){
+    std::vector<topk_row> rows;
+    auto code = [&](int index){
+        return std::string(tables.code_at(index).value_or(""));
+    };
+    for(const auto& c : sketches.ATC.top(k))
+        rows.push_back({"ATC", c.key, code(c.key), "", c.count, c.error});
+    for(const auto& c : sketches.PT.top(k))
+        rows.push_back({"PT", INT_MIN, "", c.key, c.count, c.error});
+    for(const auto& c : sketches.ATC_PT.top(k))
+        rows.push_back({"ATC_PT", c.key.first, code(c.key.first), c.key.second, c.count, c.error});
+    return rows;
+}
+
+//count is an upper bound of the number of reports, count - error a lower bound
+void export_topk(const std::vector<topk_row>& rows, std::string_view out_path){
+    std::ofstream ofs{std::string(out_path)};
+    if(!ofs.is_open()){
+        std::cout << "Error opening: " << out_path <<  "\n";
+        return;
+    }
+    ofs << "type ; ATC ; ATC_code ; PT ; count ; error \n";
+    for(const auto& row : rows){
+        ofs << row.type << ';';
+        if(row.ATC != INT_MIN)
+            ofs << row.ATC;
+        ofs << ';' << row.ATC_code << ';' << row.PT << ';' << row.count << ';' << row.error << '\n';
+    }
+}
+
+void export_topk_rds(const std::vector<topk_row>& rows, std::string_view out_path){
+    rds_writer rds{std::string(out_path)};
+    if(!rds.is_open()){
+        std::cout << "Error opening: " << out_path <<  "\n";
+        return;
+    }
+    std::vector<std::string> type, ATC_code, PT;
+    std::vector<int> ATC, count, error;
+    for(const auto& row : rows){
+        type.push_back(row.type);
+        ATC.push_back(row.ATC);
+        ATC_code.push_back(row.ATC_code);
+        PT.push_back(row.PT);
+        count.push_back(static_cast<int>(std::min<uint64_t>(row.count, INT_MAX)));
+        error.push_back(static_cast<int>(std::min<uint64_t>(row.error, INT_MAX)));
+    }
+    rds.begin_data_frame(6);
+    rds.write_string_vector(type);
+    rds.write_integer_vector(ATC);
+    rds.write_string_vector(ATC_code);
+    rds.write_string_vector(PT);
+    rds.write_integer_vector(count);
+    rds.write_integer_vector(error);
+    rds.end_data_frame({"type", "ATC", "ATC_code", "PT", "count", "error"}, rows.size());
+}
+
+//CRC-32 (the one of zlib, gzip and PNG) of the --shards manifest, crc is the
+//value returned for the previous bytes so that a file is checksummed in pieces
+uint32_t crc32_update(uint32_t crc, std::string_view bytes){
+    static const auto table = []{
+        std::array<uint32_t, 256> t{};
+        for(uint32_t i = 0; i < 256; ++i){
+            uint32_t c = i;
+            for(int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for(unsigned char b : bytes)
+        crc = table[(crc ^ b) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+//nullopt when the file cannot be read to its end
+std::optional<uint32_t> file_crc32(const std::string& path){
+    std::ifstream ifs(path, std::ios::binary);
+    if(!ifs.is_open())
+        return std::nullopt;
+    std::string chunk(1 << 16, '\0');
+    uint32_t crc = 0;
+    while(ifs.read(chunk.data(), chunk.size()) || ifs.gcount() > 0)
+        crc = crc32_update(crc, std::string_view(chunk.data(), ifs.gcount()));
+    if(ifs.bad())
+        return std::nullopt;
+    return crc;
+}
+
+//one output file of --all, --specific or --csvspecific. Rows are written as they
+//come, the columns of an .rds file are only put together by close().
+//rows, bytes and the CRC-32 of the file are known after close(), they are only
+//meaningful when failed() is false (the file could be opened and every write succeeded)
+class shard_writer{
+public:
+    shard_writer(const std::string& path, bool with_ADR, const std::vector<std::string>& field_names)
+        : path_{path}, with_ADR_{with_ADR}, rds_{is_rds_path(path)}, field_names_{field_names}{
+        if(rds_){
+            rds_out_.emplace(open_patients_rds(path, with_ADR, field_names));
+            if(!rds_out_->is_open()){
+                std::cout << "Error opening: " << path <<  "\n";
+                failed_ = true;
+            }
+            return;
+        }
+        ofs_.open(path, std::ios::binary);
+        if(!ofs_.is_open()){
+            std::cout << "Error opening: " << path <<  "\n";
+            failed_ = true;
+            return;
+        }
+        if(with_ADR_)
+            buffer_ << "patientATC ; patientADR \n";
+        else
+            write_patients_header(buffer_, field_names_);
+        flush();
+    }
+
+    inline bool is_open() const{
+        return rds_ ? rds_out_->is_open() : ofs_.is_open();
+    }
+
+    void write(const std::vector<patient>& patients, const std::vector<bool>& ADR){
+        rows_ += patients.size();
+        if(rds_){
+            for(std::size_t i = 0; i < patients.size(); ++i)
+                write_patient_rds(*rds_out_, patients[i], with_ADR_, with_ADR_ && ADR[i]);
+            return;
+        }
+        for(std::size_t i = 0; i < patients.size(); ++i){
+            if(with_ADR_){
+                write_code_with_AE(buffer_, patients[i], ADR[i]);
+            }else{
+                patients[i].export_csv(buffer_);
+                buffer_ << '\n';
+            }
+        }
+        flush();
+    }
+
+    void close(){
+        //a file which could not be opened has already been reported
+        if(!is_open())
+            return;
+        if(!rds_){
+            ofs_.close();
+            failed_ = failed_ || ofs_.fail();
+        }else if(rds_out_->close()){
+            std::error_code ec;
+            bytes_ = std::filesystem::file_size(path_, ec);
+            auto crc = ec ? std::nullopt : file_crc32(path_);
+            failed_ = !crc;
+            crc_ = crc.value_or(0);
+        }else{
+            failed_ = true;
+        }
+        if(failed_)
+            std::cout << "Error writing: " << path_ << "\n";
+    }
+
+    inline bool failed() const{ return failed_; }
+    inline const std::string& path() const{ return path_; }
+    inline std::size_t rows() const{ return rows_; }
+    inline std::uintmax_t bytes() const{ return bytes_; }
+    inline uint32_t crc() const{ return crc_; }
+
+private:
+    //the rows are formatted in buffer_ and checksummed as they are written
+    void flush(){
+        std::string text = buffer_.str();
+        buffer_.str("");
+        if(failed_)
+            return;
+        if(!ofs_.write(text.data(), text.size())){
+            failed_ = true;
+            return;
+        }
+        crc_ = crc32_update(crc_, text);
+        bytes_ += text.size();
+    }
+
+    std::string path_;
+    bool with_ADR_;
+    bool rds_;
+    std::vector<std::string> field_names_;
+    std::ofstream ofs_;
+    std::ostringstream buffer_;
+    std::optional<rds_data_frame_writer> rds_out_;
+    std::size_t rows_ = 0;
+    std::uintmax_t bytes_ = 0;
+    uint32_t crc_ = 0;
+    bool failed_ = false;
+};
+
+//name of shard i : results.csv -> results-00002-of-00008.csv
+std::string shard_path(const std::string& path, std::size_t i, std::size_t shards){
+    std::size_t dot = path.find_last_of('.');
+    if(dot == std::string::npos || dot < path.find_last_of('/') + 1)
+        dot = path.size();
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), "-%05zu-of-%05zu", i, shards);
+    return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+//results.csv -> results.manifest.csv
+std::string manifest_path(const std::string& path){
+    std::size_t dot = path.find_last_of('.');
+    if(dot == std::string::npos || dot < path.find_last_of('/') + 1)
+        dot = path.size();
+    return path.substr(0, dot) + ".manifest.csv";
+}
+
+//output of the patients, fed with the batches in the input order. Without
+//--shards (shards = 0) it is the single file path. With --shards N the patients
+//are spread on N files by a hash of their report id, so that a report always
+//lands in the same shard whatever the threads or batch size. Each shard has its
+//own writer thread and keeps the input order, close() writes the manifest when
+//every shard has been written entirely
+class patient_output{
+public:
+    patient_output(const std::string& path, bool with_ADR, const std::vector<std::string>& field_names,
+                   std::size_t shards = 0) : path_{path}{
+        if(shards == 0){
+            shards_.push_back(std::make_unique<shard_writer>(path, with_ADR, field_names));
+            return;
+        }
+        //the manifest of a previous run would vouch for the shards being rewritten
+        std::error_code ec;
+        std::filesystem::remove(manifest_path(path), ec);
+        for(std::size_t i = 0; i < shards; ++i){
+            shards_.push_back(std::make_unique<shard_writer>(shard_path(path, i, shards), with_ADR, field_names));
+            queues_.push_back(std::make_unique<bounded_queue<patient_batch>>(4));
+        }
+        for(std::size_t i = 0; i < shards; ++i){
+            threads_.emplace_back([this, i]{
+                patient_batch batch;
+                while(queues_[i]->pop(batch))
+                    shards_[i]->write(batch.patients, batch.ADR);
+                shards_[i]->close();
+            });
+        }
+    }
+
+    ~patient_output(){
+        if(!closed_)
+            close();
+    }
+
+    inline bool is_open() const{
+        return std::all_of(shards_.begin(), shards_.end(), [](const auto& shard){ return shard->is_open(); });
+    }
+
+    void write(patient_batch& batch){
+        if(queues_.empty()){
+            shards_.front()->write(batch.patients, batch.ADR);
+            return;
+        }
+        std::vector<patient_batch> split(queues_.size());
+        for(std::size_t i = 0; i < batch.patients.size(); ++i){
+            const std::string& id = batch.patients[i].get_id();
+            auto& shard = split[table_hash(id, 0) % split.size()];
+            shard.patients.push_back(std::move(batch.patients[i]));
+            if(!batch.ADR.empty())
+                shard.ADR.push_back(batch.ADR[i]);
+        }
+        for(std::size_t i = 0; i < split.size(); ++i){
+            if(!split[i].patients.empty())
+                queues_[i]->push(std::move(split[i]));
+        }
+    }
+
+    //false when a file could not be opened or written entirely
+    bool close(){
+        closed_ = true;
+        if(queues_.empty()){
+            shards_.front()->close();
+            return !shards_.front()->failed();
+        }
+        for(auto& queue : queues_)
+            queue->close();
+        for(auto& thread : threads_)
+            thread.join();
+        //a manifest would make an incomplete output look valid
+        if(std::any_of(shards_.begin(), shards_.end(), [](const auto& shard){ return shard->failed(); })){
+            std::cout << "Error: the output is incomplete, no manifest has been written.\n";
+            return false;
+        }
+        return write_manifest();
+    }
+
+private:
+    //one line per shard : file name (relative to the manifest), rows, bytes and CRC-32
+    bool write_manifest() const{
+        std::string path = manifest_path(path_);
+        std::ofstream ofs(path);
+        if(!ofs.is_open()){
+            std::cout << "Error opening: " << path <<  "\n";
+            return false;
+        }
+        ofs << "file ; rows ; bytes ; crc32 \n";
+        for(const auto& shard : shards_){
+            char crc[9];
+            std::snprintf(crc, sizeof(crc), "%08x", shard->crc());
+            ofs << std::filesystem::path(shard->path()).filename().string() << ';' << shard->rows()
+                << ';' << shard->bytes() << ';' << crc << '\n';
+        }
+        ofs.close();
+        if(ofs.fail()){
+            std::cout << "Error writing: " << path << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    std::string path_;
+    std::vector<std::unique_ptr<shard_writer>> shards_;
+    std::vector<std::unique_ptr<bounded_queue<patient_batch>>> queues_;
+    std::vector<std::thread> threads_;
+    bool closed_ = false;
+};
+
+//parse -> map/label -> write stages connected by bounded queues of batches :
+//a parser thread streams the reports (sampling them when a sampler is given),
+//options.threads workers run map_patient_batch and the calling thread writes the
+//batches back in the input order. The reservoir samples are only known at the end
+//of the input, they are sent after the other patients.
+//With --topk there is no output, each worker sketches its batches and merges
+//its sketches in topk when the input is exhausted
+void run_pipeline(report_reader& reader, const patient_fields& fields,
+                  const std::map<std::string,std::string>& map_standardized,
+                  const atc_tables& tables, const std::regex* AE_reg,
+                  report_sampler* sampler, patient_output* output, topk_sketches* topk,
+                  const pipeline_options& options, pipeline_counters& counters){
+    bounded_queue<patient_batch> parsed(options.queue_depth);
+    bounded_queue<patient_batch> mapped(options.queue_depth);
+    //batches written so far : the parser stays at most window batches ahead of the
+    //writer, which bounds the reorder buffer when one batch is slow to map
+    const std::size_t window = 2 * options.queue_depth + options.threads;
+    std::atomic<std::size_t> written{0};
+
+    std::thread parser([&]{
+        report_record record;
+        patient_batch batch;
+        std::size_t sequence = 0;
+        auto push_batch = [&]{
+            batch.sequence = sequence++;
+            //without an output the batches are not written back, there is nothing to reorder
+            for(std::size_t done; output && batch.sequence >= (done = written.load(std::memory_order_acquire)) + window; )
+                written.wait(done, std::memory_order_acquire);
+            parsed.push(std::move(batch));
+        };
+        auto add_patient = [&](patient&& pat){
+            batch.patients.push_back(std::move(pat));
+            if(batch.patients.size() == options.batch_size){
+                push_batch();
+                batch = patient_batch{};
+                batch.patients.reserve(options.batch_size);
+            }
+        };
+        while(reader.next(record)){
+            patient pat = patient_from_record(record, fields);
+            if(sampler){
+                bool has_AE = sampler->stratified() && patient_has_AE(pat, *AE_reg);
+                if(!sampler->offer(pat, has_AE))
+                    continue;
+            }
+            add_patient(std::move(pat));
+        }
+        if(sampler){
+            for(auto& pat : sampler->drain())
+                add_patient(std::move(pat));
+        }
+        if(!batch.patients.empty())
+            push_batch();
+        parsed.close();
+    });
+
+    std::atomic<std::size_t> running_workers{options.threads};
+    std::mutex topk_mutex;
+    std::vector<std::thread> workers;
+    for(std::size_t i = 0; i < options.threads; ++i){
+        workers.emplace_back([&]{
+            drug_resolver resolver(map_standardized, tables);
+            std::optional<topk_sketches> sketches;
+            if(topk)
+                sketches.emplace(topk->PT.capacity());
+            patient_batch batch;
+            while(parsed.pop(batch)){
+                map_patient_batch(batch, resolver, AE_reg, counters);
+                if(sketches){
+                    for(const auto& pat : batch.patients)
+                        sketches->add(pat);
+                }
+                if(output)
+                    mapped.push(std::move(batch));
+            }
+            if(sketches){
+                std::lock_guard<std::mutex> lock(topk_mutex);
+                topk->merge(*sketches);
+            }
+            if(--running_workers == 0)
+                mapped.close();
+        });
+    }
+
+    //the workers finish the batches in any order, they are written back in sequence.
+    //pending holds less than window batches
+    std::map<std::size_t, patient_batch> pending;
+    std::size_t next_sequence = 0;
+    patient_batch batch;
+    while(mapped.pop(batch)){
+        pending.emplace(batch.sequence, std::move(batch));
+        for(auto it = pending.begin(); it != pending.end() && it->first == next_sequence; it = pending.erase(it)){
+            output->write(it->second);
+            written.store(++next_sequence, std::memory_order_release);
+            written.notify_one();
+        }
+    }
+
+    parser.join();
+    for(auto& worker : workers)
+        worker.join();
+}
+
+//value of a numeric option, the whole text has to be a number within [min, max]
+//(no sign, no trailing characters) otherwise an error is printed
+template<typename T>
+bool parse_number(std::string_view text, std::string_view option, T min, T max, T& value){
+    T parsed{};
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), parsed);
+    if(ec != std::errc{} || end != text.data() + text.size() || parsed < min || parsed > max){
+        std::cerr << "Error: " << option << " expects a number between " << min << " and " << max
+                  << ", got " << text << ".\n";
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
 int main(int argc, char* argv[]){
 
     struct option long_options[] = {
@@ -701,19 +1323,38 @@ int main(int argc, char* argv[]){
         {"input",required_argument, nullptr, 'i'},
         {"output",required_argument, nullptr, 'o'},
         {"mapping", required_argument, nullptr, 'm'},
+        {"atc-tree", required_argument, nullptr, 't'},
+        {"atc-binder", required_argument, nullptr, 'b'},
+        {"fields", required_argument, nullptr, 'f'},
+        {"where", required_argument, nullptr, 'w'},
+        {"threads", required_argument, nullptr, 'j'},
+        {"batch-size", required_argument, nullptr, 'B'},
+        {"queue-depth", required_argument, nullptr, 'Q'},
+        {"sample", required_argument, nullptr, 'S'},
+        {"seed", required_argument, nullptr, 'r'},
+        {"topk", required_argument, nullptr, 'k'},
+        {"shards", required_argument, nullptr, 'n'},
         {"verbose", no_argument, nullptr, 'v'},
         {nullptr,0,nullptr,0}
     };
 
     int opt;
-    bool all, mapping_processed = false, verbose = false;
+    bool all = false, mapping_processed = false, verbose = false;
     std::string specific_AE;
     std::string csv_specific_AE;
     std::string input_file;
     std::string output_file;// csv_outputfile
     std::string mapping_path;
-    std::vector<patient> clean_patients_list;
-    while((opt = getopt_long(argc, argv, "aps:c:i:o:m:v", long_options, nullptr)) != -1){
+    std::string atc_tree_path;
+    std::string atc_binder_path;
+    std::vector<std::string> extra_field_names;
+    std::vector<std::string> where_expressions;
+    pipeline_options pipeline;
+    std::string sample_spec;
+    uint64_t seed = std::random_device{}();
+    std::size_t topk = 0;
+    std::size_t shards = 0;
+    while((opt = getopt_long(argc, argv, "aps:c:i:o:m:t:b:f:w:j:B:Q:S:r:k:n:v", long_options, nullptr)) != -1){
         switch (opt)
         {
         case 'a':
@@ -737,6 +1378,47 @@ int main(int argc, char* argv[]){
         case 'm':
             mapping_path = optarg;
             break;
+        case 't':
+            atc_tree_path = optarg;
+            break;
+        case 'b':
+            atc_binder_path = optarg;
+            break;
+        case 'f':
+            extra_field_names = string_to_vector(optarg);
+            break;
+        case 'w':
+            where_expressions.push_back(optarg);
+            break;
+        case 'j':
+            if(!parse_number<std::size_t>(optarg, "--threads", 1, 1024, pipeline.threads))
+                return 1;
+            break;
+        case 'B':
+            if(!parse_number<std::size_t>(optarg, "--batch-size", 1, 1 << 20, pipeline.batch_size))
+                return 1;
+            break;
+        case 'Q':
+            if(!parse_number<std::size_t>(optarg, "--queue-depth", 1, 1 << 16, pipeline.queue_depth))
+                return 1;
+            break;
+        case 'S':
+            sample_spec = optarg;
+            break;
+        case 'r':
+            if(!parse_number<uint64_t>(optarg, "--seed", 0, UINT64_MAX, seed))
+                return 1;
+            break;
+        case 'k':
+            //the sketches hold 10 * topk counters
+            if(!parse_number<std::size_t>(optarg, "--topk", 1, 100000, topk))
+                return 1;
+            break;
+        case 'n':
+            //one file and one writer thread per shard
+            if(!parse_number<std::size_t>(optarg, "--shards", 1, 4096, shards))
+                return 1;
+            break;
         case 'v':
             verbose = true;
             break;
@@ -754,64 +1436,71 @@ int main(int argc, char* argv[]){
         std::cerr << "Error: The --output option is mandatory. Please add it.\n";
         return 1;
     }
-    if((all || !specific_AE.empty()) && (mapping_path.empty() && !mapping_processed ) ){
+    if((all || !specific_AE.empty() || topk) && (mapping_path.empty() && !mapping_processed ) ){
         std::cerr << "Error: The --mapping option is mandatory when going from xml to csv. Please add it.\n";
         return 1;
     }
 
-    int option_count = (all ? 1 : 0) + (!specific_AE.empty() ? 1 : 0) + (!csv_specific_AE.empty() ? 1 : 0);
+    int option_count = (all ? 1 : 0) + (!specific_AE.empty() ? 1 : 0) + (!csv_specific_AE.empty() ? 1 : 0)
+                       + (topk ? 1 : 0);
     if (option_count != 1) {
-        std::cerr << "Error: Only one of --all, --specific, or --csvspecific can be specified at a time.\n";
+        std::cerr << "Error: Only one of --all, --specific, --csvspecific or --topk can be specified at a time.\n";
+        return 1;
+    }
+
+    if (shards && topk) {
+        std::cerr << "Error: --shards does not apply to --topk.\n";
         return 1;
     }
 
+    std::optional<report_sampler> sampler;
+    if (!sample_spec.empty()) {
+        sampler.emplace();
+        if (!sampler->parse(sample_spec, seed)) {
+            std::cerr << "Error: malformed --sample, expected a rate (5% or 0.05), a size (20000) or one of them per stratum (100%,5%).\n";
+            return 1;
+        }
+        if (!csv_specific_AE.empty()) {
+            std::cerr << "Error: --sample only applies to XML inputs.\n";
+            return 1;
+        }
+        if (sampler->stratified() && specific_AE.empty()) {
+            std::cerr << "Error: a stratified --sample needs the --specific AE.\n";
+            return 1;
+        }
+    }
+
       
     std::cout << "Input file: " << input_file << "\n";
     std::cout << "Output file: " << output_file << "\n";
 
     
-    pugi::xml_document doc;
-
-   if(all || !specific_AE.empty()){  
-    auto status = load_xml_file(input_file,doc);
-    if(!status)
-        return -1;
-    
-    auto patients = doc.select_nodes("/ichicsr/safetyreport/patient");
-    auto patients_id = doc.select_nodes("/ichicsr/safetyreport");
-    
-    std::vector<std::string> id_list;
-    id_list.reserve(patients_id.size());
-    for(auto pat : patients_id){
-        std::string bop = pat.node().child("safetyreportid").child_value();
-        id_list.push_back(bop);
+   if(all || !specific_AE.empty() || topk){  
+    //only the fields listed here are extracted from the XML, the rest of each report is skipped
+    field_list fields;
+    fields.add("safetyreportid");
+    fields.add("medicinalproduct");
+    fields.add("reactionmeddrapt");
+    patient_fields fields_index{*fields.index_of("safetyreportid"), *fields.index_of("medicinalproduct"),
+                                *fields.index_of("reactionmeddrapt"), {}};
+    for(const auto& name : extra_field_names)
+        fields_index.extra.push_back(fields.add(name));
+
+    //reports are filtered while they are read, before any drug lookup
+    report_filter filter;
+    for(const auto& expression : where_expressions){
+        if(!filter.add(expression, fields)){
+            std::cerr << "Error: malformed --where expression : " << expression << "\n";
+            return 1;
+        }
     }
-    
-
-    std::map<std::string,std::string> raw_patient_drug_list;
-    //Get the drugs for each patients in the format "drug1;drug2;...drug_n";
-    raw_patient_drug_list = patient_drugs(patients, id_list);
- 
-
-    //Convert the raw patients list in a nice vector structure
-    std::map<std::string,std::vector<std::string>> patients_drugs_list;
-
-    //Get the drugs for each patient in the form ["drug1","drug2",...,"drug_n"]
-    patients_drugs_list = extract_drugs_from_raw(raw_patient_drug_list);
-    // Get the Adverse events for each patients :
-    auto patients_AEs_list = patient_adverse_events(patients, id_list);
-
-
 
-    //auto patients_AE_counts = get_number_of_AE_per_AE(patients_AEs_list);
-    
-    std::vector<patient> patients_list;
-    patients_list.reserve(patients_drugs_list.size());
-    for(const auto& [k,v] : patients_drugs_list){
-        patients_list.emplace_back(k,v,patients_AEs_list.at(k));
+    report_reader reader(input_file, fields, filter);
+    if(!reader.is_open()){
+        std::cout << "Error opening the xml file.\n";
+        return -1;
     }
     
-    
     //convert the standardized drugname csv in a cpp structure (map justifiée car à priori un drugname par substance)
     std::string mapping_path_2_columns = "./drugnames_standardized_2_columns.csv";
     if(!mapping_processed)
@@ -823,65 +1512,85 @@ int main(int argc, char* argv[]){
 
     //here we need to be cautious, there are multiple ATC code for a single substance
     // furthermore some primary code are Z (?)
-    std::string path_atc_mapping = "./ATC_binder_2024.csv";
-    std::map<std::string, std::string> map_standardized_to_ATC = get_atc_from_standardized(path_atc_mapping);
+    //the ATC binder and tree are compiled in, a CSV given at runtime replaces them
+    atc_tables ATC_tables;
+    if(!atc_binder_path.empty() && !ATC_tables.load_binder(atc_binder_path))
+        return -1;
+    if(!atc_tree_path.empty() && !ATC_tables.load_tree(atc_tree_path))
+        return -1;
+    if(!ATC_tables.has_binder()){
+        std::cerr << "Error: no ATC binder has been embedded in this build, please add --atc-binder.\n";
+        return 1;
+    }
+
+    //with --specific the workers also compute the AE boolean of each patient
+    std::regex AE_reg;
+    if(!specific_AE.empty())
+        AE_reg = build_regex(specific_AE);
+
+    std::optional<patient_output> output;
+    if(!topk){
+        output.emplace(output_file, !specific_AE.empty(), extra_field_names, shards);
+        if(!output->is_open())
+            return -1;
+    }
+    //the sketches monitor 10 times more keys than reported, see the README for the error bounds
+    std::optional<topk_sketches> sketches;
+    if(topk)
+        sketches.emplace(10 * topk);
 
-    
-    std::string path_tree = "./ATC_tree.csv";    
-    std::ifstream ist_tree(path_tree); 
-    //auto ATC_code = get_atc_code(ist_tree);
-    //auto ATC_code_name = get_atc_tree(ist_tree);
-    auto ATC_code_index = get_atc_tree_index(ist_tree);
-    ist_tree.close();
-    
-    //from the patient drug list, get the standardized substances names in order to use the ATCtree
-    
-    string_list patients_substances_list;
     //each patient have now a substances list corresponding to their medication,
     //we found the substances composing each medication in "drugnames_standardized_med_only.csv"
-    get_patients_substances(map_standardized, patients_list);
-    if(verbose)
-        std::cout << "Patient number before cutting NA substance : " << patients_list.size() << '\n';
     //we just delete row when the substances hasn't been found -> not the best ? 
-    clean_patients_list = delete_NA_substances(patients_list);
+    pipeline_counters counters;
+    run_pipeline(reader, fields_index, map_standardized, ATC_tables,
+                 specific_AE.empty() ? nullptr : &AE_reg, sampler ? &*sampler : nullptr,
+                 output ? &*output : nullptr, sketches ? &*sketches : nullptr, pipeline, counters);
+    if(output && !output->close())
+        return -1;
+    if(sketches){
+        auto rows = topk_rows(*sketches, topk, ATC_tables);
+        if(is_rds_path(output_file))
+            export_topk_rds(rows, output_file);
+        else
+            export_topk(rows, output_file);
+    }
 
-    if(verbose)
-        std::cout << "Patient number after cutting NA substance : " << clean_patients_list.size() << '\n';
-    
-    
-    get_ATC_code_from_substances(clean_patients_list, map_standardized_to_ATC);
-    //remove patients containing "NA" in their ATC list 
-    clean_patients_list = delete_NA_substances(clean_patients_list);
-    if(verbose)
-        std::cout << "Patient number after cutting NA ATC_code : " << clean_patients_list.size() << '\n';
-
-    get_index_from_ATC_code(clean_patients_list, ATC_code_index);
-    clean_patients_list = delete_NA_code(clean_patients_list);
-    if(verbose)
-        std::cout << "Patient number after removing INT_MIN from ATC_code : " << clean_patients_list.size() << '\n';
-
-    //we export this if user wants the file with every AE
-    if(all && !output_file.empty()){
-        export_patients(clean_patients_list, output_file);
-        std::cout << "Succesfully exported data to : "<< output_file <<"\n";
+    if(verbose){
+        if(!filter.empty())
+            std::cout << "Number of reports rejected by --where : " << reader.rejected() << '\n';
+        if(sampler)
+            std::cout << "Number of reports sampled (seed " << seed << ") : " << sampler->sampled() << '\n';
+        std::cout << "Patient number before cutting NA substance : " << counters.read << '\n';
+        std::cout << "Patient number after cutting NA substance : " << counters.substances << '\n';
+        std::cout << "Patient number after cutting NA ATC_code : " << counters.ATC_code << '\n';
+        std::cout << "Patient number after removing INT_MIN from ATC_code : " << counters.ATC_index << '\n';
+        if(sketches){
+            //error <= total / capacity for every key of a sketch
+            std::cout << "Maximum --topk error (ATC / PT / ATC_PT) : "
+                      << sketches->ATC.total() / sketches->ATC.capacity() << " / "
+                      << sketches->PT.total() / sketches->PT.capacity() << " / "
+                      << sketches->ATC_PT.total() / sketches->ATC_PT.capacity() << '\n';
+        }
     }
-    
+    std::cout << "Succesfully exported data to : "<< output_file <<"\n";
 
    }
 
 
-    if(!all){
-        std::vector<patient> imported_patients;
-        if(!csv_specific_AE.empty())
-            imported_patients = read_patients_csv(input_file);
-        else
-            imported_patients = clean_patients_list;
-        
-        std::string desired_AE = csv_specific_AE.empty() ? specific_AE : csv_specific_AE;
-        std::regex AE_reg = build_regex(desired_AE);
+    if(!csv_specific_AE.empty()){
+        std::vector<patient> imported_patients = read_patients_csv(input_file);
+        std::regex AE_reg = build_regex(csv_specific_AE);
 
-        std::vector<bool> ADR = get_AE_boolean_regex(AE_string_list_from_patient_vector(imported_patients), AE_reg);
-        export_code_with_AE(imported_patients, ADR, output_file);
+        patient_batch batch;
+        batch.ADR = get_AE_boolean_regex(AE_string_list_from_patient_vector(imported_patients), AE_reg);
+        batch.patients = std::move(imported_patients);
+        patient_output output(output_file, true, {}, shards);
+        if(!output.is_open())
+            return -1;
+        output.write(batch);
+        if(!output.close())
+            return -1;
         std::cout << "Succesfully exported data to : "<< output_file <<"\n";
     }
 
@@ -0,0 +1,146 @@
+#include "normalize.hpp"
+
+#include <cstddef>
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(FAERS_SCALAR_NORMALIZE)
+#define FAERS_X86_NORMALIZE
+#include <immintrin.h>
+#endif
+
+namespace {
+
+constexpr std::size_t npos = std::string::npos;
+
+struct scan_state{
+    std::size_t first = npos; //first character which is not a space
+    std::size_t last = 0;     //last character which is not a space
+    bool has_delimiter = false;
+};
+
+inline bool is_space(unsigned char c){
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+inline bool is_delimiter(unsigned char c){
+    return c == '/' || c == '(' || c == '[' || c == '{' || c == '^';
+}
+
+void scan_scalar(char* data, std::size_t begin, std::size_t end, scan_state& state){
+    for(std::size_t i = begin; i < end; ++i){
+        unsigned char c = data[i];
+        if(unsigned(c - 'A') < 26u)
+            data[i] = char(c | 0x20);
+        if(!is_space(c)){
+            if(state.first == npos)
+                state.first = i;
+            state.last = i;
+        }
+        state.has_delimiter |= is_delimiter(c);
+    }
+}
+
+#ifdef FAERS_X86_NORMALIZE
+
+//bit i of non_space is set when character offset + i is not a space
+inline void update_bounds(unsigned non_space, std::size_t offset, scan_state& state){
+    if(non_space == 0)
+        return;
+    if(state.first == npos)
+        state.first = offset + __builtin_ctz(non_space);
+    state.last = offset + 31 - __builtin_clz(non_space);
+}
+
+void scan_sse2(char* data, std::size_t begin, std::size_t end, scan_state& state){
+    const __m128i before_A = _mm_set1_epi8('A' - 1);
+    const __m128i after_Z = _mm_set1_epi8('Z' + 1);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    std::size_t i = begin;
+    for(; i + 16 <= end; i += 16){
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_A), _mm_cmplt_epi8(v, after_Z));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_or_si128(v, _mm_and_si128(upper, case_bit)));
+
+        __m128i space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+                                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+        update_bounds(~unsigned(_mm_movemask_epi8(space)) & 0xffffu, i, state);
+
+        __m128i delimiter = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')),
+                                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('('))),
+                                         _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('[')),
+                                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('{'))));
+        delimiter = _mm_or_si128(delimiter, _mm_cmpeq_epi8(v, _mm_set1_epi8('^')));
+        state.has_delimiter |= _mm_movemask_epi8(delimiter) != 0;
+    }
+    scan_scalar(data, i, end, state);
+}
+
+void scan_text_sse2(char* data, std::size_t size, scan_state& state){
+    scan_sse2(data, 0, size, state);
+}
+
+__attribute__((target("avx2")))
+void scan_text_avx2(char* data, std::size_t size, scan_state& state){
+    const __m256i before_A = _mm256_set1_epi8('A' - 1);
+    const __m256i after_Z = _mm256_set1_epi8('Z' + 1);
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    std::size_t i = 0;
+    for(; i + 32 <= size; i += 32){
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, before_A), _mm256_cmpgt_epi8(after_Z, v));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i),
+                            _mm256_or_si256(v, _mm256_and_si256(upper, case_bit)));
+
+        __m256i space = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')),
+                                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+        update_bounds(~unsigned(_mm256_movemask_epi8(space)), i, state);
+
+        __m256i delimiter = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')),
+                                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('('))),
+                                            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')),
+                                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('{'))));
+        delimiter = _mm256_or_si256(delimiter, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('^')));
+        state.has_delimiter |= _mm256_movemask_epi8(delimiter) != 0;
+    }
+    scan_sse2(data, i, size, state);
+}
+
+#else
+
+void scan_text_scalar(char* data, std::size_t size, scan_state& state){
+    scan_scalar(data, 0, size, state);
+}
+
+#endif
+
+using scan_function = void (*)(char*, std::size_t, scan_state&);
+
+scan_function select_scan(){
+#ifdef FAERS_X86_NORMALIZE
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return scan_text_avx2;
+    return scan_text_sse2;
+#else
+    return scan_text_scalar;
+#endif
+}
+
+const scan_function scan_text = select_scan();
+
+}
+
+text_flags normalize_ascii(std::string& text){
+    scan_state state;
+    scan_text(text.data(), text.size(), state);
+    if(state.first == npos){
+        text.clear();
+    }else{
+        text.erase(state.last + 1);
+        text.erase(0, state.first);
+    }
+    return {state.has_delimiter};
+}
@@ -0,0 +1,18 @@
+#ifndef FAERS_NORMALIZE_HPP
+#define FAERS_NORMALIZE_HPP
+
+#include <string>
+
+//what normalize_ascii found while scanning the text
+struct text_flags{
+    //one of the delimiters / ( [ { ^ used by apply_correction_drug
+    bool has_delimiter = false;
+};
+
+//single pass normalization of every text read (drug names, PTs, mapping files) :
+//ASCII lowercase, trim of spaces, tabs, \r and \n, and delimiter detection.
+//The SSE2 / AVX2 kernel is chosen at runtime on x86-64, other targets (or a
+//build with FAERS_SCALAR_NORMALIZE defined) use the scalar version
+text_flags normalize_ascii(std::string& text);
+
+#endif
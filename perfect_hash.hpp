@@ -0,0 +1,38 @@
+#ifndef FAERS_PERFECT_HASH_HPP
+#define FAERS_PERFECT_HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+//hash shared by the table generator (tools/embed_tables.cpp) and the parser,
+//both sides have to agree on it for the embedded tables to be usable
+constexpr uint32_t table_hash(std::string_view key, uint32_t seed){
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for(unsigned char c : key){
+        h ^= c;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+//minimal perfect hash (hash and displace) : the key goes in the bucket
+//table_hash(key,0) % seeds.size(), the seed stored for this bucket gives the
+//slot, and slots[] gives the position of the key in the sorted key array.
+//returns keys.size() when the key is not in the table
+constexpr std::size_t perfect_hash_find(std::string_view key,
+                                        std::span<const std::string_view> keys,
+                                        std::span<const uint32_t> seeds,
+                                        std::span<const uint32_t> slots){
+    if(keys.empty())
+        return keys.size();
+    uint32_t seed = seeds[table_hash(key, 0) % seeds.size()];
+    std::size_t pos = slots[table_hash(key, seed) % slots.size()];
+    return keys[pos] == key ? pos : keys.size();
+}
+
+#endif
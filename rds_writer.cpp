@@ -0,0 +1,211 @@
+#include "rds_writer.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+
+namespace {
+
+//SEXPTYPEs and flags from R's serialize.c
+constexpr int SYMSXP = 1;
+constexpr int LISTSXP = 2;
+constexpr int CHARSXP = 9;
+constexpr int LGLSXP = 10;
+constexpr int INTSXP = 13;
+constexpr int STRSXP = 16;
+constexpr int VECSXP = 19;
+constexpr int NILVALUE_SXP = 254;
+
+constexpr int IS_OBJECT_BIT_MASK = 1 << 8;
+constexpr int HAS_ATTR_BIT_MASK = 1 << 9;
+constexpr int HAS_TAG_BIT_MASK = 1 << 10;
+
+constexpr int UTF8_MASK = 1 << 3;
+constexpr int ASCII_MASK = 1 << 6;
+
+constexpr int32_t NA_INTEGER = INT_MIN;
+
+constexpr int32_t r_version(int v, int p, int s){
+    return v * 65536 + p * 256 + s;
+}
+
+}
+
+rds_writer::rds_writer(const std::string& path, bool header) : ofs_(path, std::ios::binary){
+    if(!ofs_.is_open() || !header)
+        return;
+    ofs_ << "X\n";
+    write_int(2);
+    write_int(r_version(4, 3, 0));
+    write_int(r_version(2, 3, 0));
+}
+
+//XDR integers are big endian
+void rds_writer::write_int(int32_t value){
+    auto v = static_cast<uint32_t>(value);
+    char bytes[4] = {char(v >> 24), char(v >> 16), char(v >> 8), char(v)};
+    ofs_.write(bytes, 4);
+}
+
+void rds_writer::write_flags(int type, int levels, bool is_object, bool has_attributes, bool has_tag){
+    int flags = type | (levels << 12);
+    if(is_object)
+        flags |= IS_OBJECT_BIT_MASK;
+    if(has_attributes)
+        flags |= HAS_ATTR_BIT_MASK;
+    if(has_tag)
+        flags |= HAS_TAG_BIT_MASK;
+    write_int(flags);
+}
+
+//lengths above INT_MAX are written as -1 followed by the two halves
+void rds_writer::write_length(std::size_t length){
+    if(length <= INT_MAX){
+        write_int(static_cast<int32_t>(length));
+    }else{
+        write_int(-1);
+        write_int(static_cast<int32_t>(length >> 32));
+        write_int(static_cast<int32_t>(length & 0xffffffffu));
+    }
+}
+
+void rds_writer::write_charsxp(std::string_view value){
+    bool ascii = std::all_of(value.begin(), value.end(), [](unsigned char c){ return c < 0x80; });
+    write_flags(CHARSXP, ascii ? ASCII_MASK : UTF8_MASK);
+    write_int(static_cast<int32_t>(value.size()));
+    ofs_.write(value.data(), value.size());
+}
+
+void rds_writer::write_symbol(std::string_view name){
+    write_flags(SYMSXP);
+    write_charsxp(name);
+}
+
+void rds_writer::begin_list(std::size_t length){
+    write_flags(VECSXP);
+    write_length(length);
+}
+
+void rds_writer::begin_data_frame(std::size_t columns){
+    write_flags(VECSXP, 0, true, true);
+    write_length(columns);
+}
+
+//the attributes of the data frame, written after its columns as a pairlist
+void rds_writer::end_data_frame(const std::vector<std::string>& names, std::size_t rows){
+    write_flags(LISTSXP, 0, false, false, true);
+    write_symbol("names");
+    write_string_vector(names);
+
+    write_flags(LISTSXP, 0, false, false, true);
+    write_symbol("class");
+    const std::string data_frame[] = {"data.frame"};
+    write_string_vector(data_frame);
+
+    //compact row names c(NA, -rows)
+    write_flags(LISTSXP, 0, false, false, true);
+    write_symbol("row.names");
+    const int row_names[] = {NA_INTEGER, -static_cast<int>(rows)};
+    write_integer_vector(row_names);
+
+    write_flags(NILVALUE_SXP);
+}
+
+void rds_writer::write_integer_vector(std::span<const int> values){
+    write_flags(INTSXP);
+    write_length(values.size());
+    for(int v : values)
+        write_int(v);
+}
+
+void rds_writer::write_string_vector(std::span<const std::string> values){
+    write_flags(STRSXP);
+    write_length(values.size());
+    for(const auto& v : values)
+        write_charsxp(v);
+}
+
+void rds_writer::begin_logical_vector(std::size_t length){
+    write_flags(LGLSXP);
+    write_length(length);
+}
+
+void rds_writer::begin_string_vector(std::size_t length){
+    write_flags(STRSXP);
+    write_length(length);
+}
+
+void rds_writer::write_logical(bool value){
+    write_int(value ? 1 : 0);
+}
+
+void rds_writer::write_string(std::string_view value){
+    write_charsxp(value);
+}
+
+void rds_writer::append(const std::string& part_path){
+    std::ifstream part(part_path, std::ios::binary);
+    if(!part.is_open()){
+        ofs_.setstate(std::ios::failbit);
+        return;
+    }
+    //an empty rdbuf() would set the failbit of ofs_
+    if(part.peek() != std::ifstream::traits_type::eof())
+        ofs_ << part.rdbuf();
+}
+
+rds_data_frame_writer::rds_data_frame_writer(const std::string& path, const std::vector<std::string>& names,
+                                             const std::vector<column>& columns)
+    : out_{path}, names_{names}, columns_{columns}{
+    for(std::size_t i = 0; i < columns_.size(); ++i){
+        part_paths_.push_back(path + '.' + std::to_string(i) + ".part");
+        parts_.push_back(std::make_unique<rds_writer>(part_paths_.back(), false));
+    }
+}
+
+bool rds_data_frame_writer::is_open() const{
+    return out_.is_open() && std::all_of(parts_.begin(), parts_.end(),
+                                         [](const auto& part){ return part->is_open(); });
+}
+
+void rds_data_frame_writer::write_integer_list(std::size_t column, std::span<const int> values){
+    parts_[column]->write_integer_vector(values);
+}
+
+void rds_data_frame_writer::write_string_list(std::size_t column, std::span<const std::string> values){
+    parts_[column]->write_string_vector(values);
+}
+
+void rds_data_frame_writer::write_logical(std::size_t column, bool value){
+    parts_[column]->write_logical(value);
+}
+
+void rds_data_frame_writer::write_string(std::size_t column, std::string_view value){
+    parts_[column]->write_string(value);
+}
+
+bool rds_data_frame_writer::close(){
+    bool parts_written = true;
+    out_.begin_data_frame(columns_.size());
+    for(std::size_t i = 0; i < columns_.size(); ++i){
+        parts_[i]->close();
+        parts_written = parts_written && !parts_[i]->failed();
+        switch(columns_[i]){
+        case column::integer_list:
+        case column::string_list:
+            out_.begin_list(rows_);
+            break;
+        case column::logical:
+            out_.begin_logical_vector(rows_);
+            break;
+        case column::string:
+            out_.begin_string_vector(rows_);
+            break;
+        }
+        out_.append(part_paths_[i]);
+        std::remove(part_paths_[i].c_str());
+    }
+    out_.end_data_frame(names_, rows_);
+    out_.close();
+    return parts_written && !out_.failed();
+}
@@ -0,0 +1,98 @@
+#ifndef FAERS_RDS_WRITER_HPP
+#define FAERS_RDS_WRITER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//writer for R's serialization format (XDR, version 2), the resulting file is
+//read by readRDS(). The file is uncompressed, readRDS detects it by itself.
+//Objects are written as they come, a data frame is written column by column :
+//  begin_data_frame(ncol) ; one write_xxx / begin_list per column ; end_data_frame(names, nrow)
+//With header = false only the objects are written, the file is then a part to append()
+class rds_writer{
+public:
+    explicit rds_writer(const std::string& path, bool header = true);
+
+    inline bool is_open() const{
+        return ofs_.is_open();
+    }
+
+    //a list of length elements, the elements are the next length objects written
+    void begin_list(std::size_t length);
+    void begin_data_frame(std::size_t columns);
+    void end_data_frame(const std::vector<std::string>& names, std::size_t rows);
+
+    void write_integer_vector(std::span<const int> values);
+    void write_string_vector(std::span<const std::string> values);
+
+    //vectors written element by element : begin_xxx_vector(length) then length write_xxx
+    void begin_logical_vector(std::size_t length);
+    void begin_string_vector(std::size_t length);
+    void write_logical(bool value);
+    void write_string(std::string_view value);
+
+    //copies the content of a part written by a rds_writer opened with header = false
+    void append(const std::string& part_path);
+
+    inline void close(){
+        ofs_.close();
+    }
+
+    //a write (or the close) failed
+    inline bool failed() const{
+        return ofs_.fail();
+    }
+
+private:
+    void write_int(int32_t value);
+    void write_flags(int type, int levels = 0, bool is_object = false,
+                     bool has_attributes = false, bool has_tag = false);
+    void write_length(std::size_t length);
+    void write_charsxp(std::string_view value);
+    void write_symbol(std::string_view name);
+
+    std::ofstream ofs_;
+};
+
+//data frame written row by row, for outputs too big to be kept in memory : the
+//length of a column comes before its elements, so the elements of each column go
+//to a temporary part (path.<column>.part) and close() writes the data frame with
+//each column header followed by a copy of its part
+class rds_data_frame_writer{
+public:
+    enum class column{integer_list, string_list, logical, string};
+
+    rds_data_frame_writer(const std::string& path, const std::vector<std::string>& names,
+                          const std::vector<column>& columns);
+
+    bool is_open() const;
+
+    //one call per column, in order, then end_row()
+    void write_integer_list(std::size_t column, std::span<const int> values);
+    void write_string_list(std::size_t column, std::span<const std::string> values);
+    void write_logical(std::size_t column, bool value);
+    void write_string(std::size_t column, std::string_view value);
+
+    inline void end_row(){
+        ++rows_;
+    }
+
+    //false when the data frame or one of its parts could not be written entirely
+    bool close();
+
+private:
+    rds_writer out_;
+    std::vector<std::string> names_;
+    std::vector<column> columns_;
+    std::vector<std::string> part_paths_;
+    std::vector<std::unique_ptr<rds_writer>> parts_;
+    std::size_t rows_ = 0;
+};
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef FAERS_SPACE_SAVING_HPP
+#define FAERS_SPACE_SAVING_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+//Space-Saving heavy hitter sketch (Metwally et al.) monitoring at most capacity keys.
+//When a key which is not monitored arrives and the sketch is full, it replaces the
+//key with the smallest count and inherits this count as its error. For every key :
+//  count - error <= true count <= count    and    error <= total() / capacity
+//so every key seen more than total() / capacity times is monitored.
+//Sketches built on disjoint parts of a stream are merged with merge(), the bounds
+//still hold for the whole stream (an absent key is assumed to have the minimum count
+//of the sketch missing it, as in the parallel Space-Saving of Cafaro et al.)
+template<typename Key, typename Hash = std::hash<Key>>
+class space_saving{
+public:
+    struct counter{
+        Key key;
+        uint64_t count = 0;
+        uint64_t error = 0;
+    };
+
+    explicit space_saving(std::size_t capacity) : capacity_{std::max<std::size_t>(capacity, 1)}{
+        counters_.reserve(capacity_);
+        heap_.reserve(capacity_);
+        position_.reserve(capacity_);
+        index_.reserve(capacity_);
+    }
+
+    inline std::size_t capacity() const{
+        return capacity_;
+    }
+
+    //sum of the weights added, the N of the error bound
+    inline uint64_t total() const{
+        return total_;
+    }
+
+    void add(const Key& key, uint64_t weight = 1){
+        total_ += weight;
+        if(auto it = index_.find(key); it != index_.end()){
+            counters_[it->second].count += weight;
+            sift_down(position_[it->second]);
+            return;
+        }
+        if(counters_.size() < capacity_){
+            uint32_t slot = counters_.size();
+            counters_.push_back({key, weight, 0});
+            index_.emplace(key, slot);
+            heap_.push_back(slot);
+            position_.push_back(heap_.size() - 1);
+            sift_up(heap_.size() - 1);
+            return;
+        }
+        //evict the smallest counter, the new key may have been counted by it
+        uint32_t slot = heap_.front();
+        auto& c = counters_[slot];
+        index_.erase(c.key);
+        c.key = key;
+        c.error = c.count;
+        c.count += weight;
+        index_.emplace(key, slot);
+        sift_down(0);
+    }
+
+    void merge(const space_saving& other){
+        uint64_t own_min = minimum(), other_min = other.minimum();
+        std::unordered_map<Key, counter, Hash> combined;
+        combined.reserve(counters_.size() + other.counters_.size());
+        for(const auto& c : counters_)
+            combined.emplace(c.key, counter{c.key, c.count + other_min, c.error + other_min});
+        for(const auto& c : other.counters_){
+            auto [it, inserted] = combined.try_emplace(c.key, counter{c.key, c.count + own_min, c.error + own_min});
+            if(!inserted){
+                it->second.count += c.count - other_min;
+                it->second.error += c.error - other_min;
+            }
+        }
+
+        std::vector<counter> merged;
+        merged.reserve(combined.size());
+        for(auto& [key, c] : combined)
+            merged.push_back(std::move(c));
+        std::size_t kept = std::min(capacity_, merged.size());
+        std::partial_sort(merged.begin(), merged.begin() + kept, merged.end(), by_count);
+        merged.resize(kept);
+
+        uint64_t total = total_ + other.total_;
+        *this = space_saving(capacity_);
+        total_ = total;
+        for(auto& c : merged){
+            uint32_t slot = counters_.size();
+            index_.emplace(c.key, slot);
+            counters_.push_back(std::move(c));
+            heap_.push_back(slot);
+            position_.push_back(heap_.size() - 1);
+            sift_up(heap_.size() - 1);
+        }
+    }
+
+    //the k monitored keys with the highest counts, highest first
+    std::vector<counter> top(std::size_t k) const{
+        std::vector<counter> sorted = counters_;
+        k = std::min(k, sorted.size());
+        std::partial_sort(sorted.begin(), sorted.begin() + k, sorted.end(), by_count);
+        sorted.resize(k);
+        return sorted;
+    }
+
+private:
+    //a key which is not monitored has been seen at most minimum() times
+    inline uint64_t minimum() const{
+        return counters_.size() < capacity_ ? 0 : counters_[heap_.front()].count;
+    }
+
+    static bool by_count(const counter& a, const counter& b){
+        return a.count != b.count ? a.count > b.count : a.error < b.error;
+    }
+
+    //heap_ is a min heap of counter slots on their count, position_ is its inverse
+    inline bool less(std::size_t a, std::size_t b) const{
+        return counters_[heap_[a]].count < counters_[heap_[b]].count;
+    }
+
+    void swap_nodes(std::size_t a, std::size_t b){
+        std::swap(heap_[a], heap_[b]);
+        position_[heap_[a]] = a;
+        position_[heap_[b]] = b;
+    }
+
+    void sift_up(std::size_t i){
+        while(i > 0 && less(i, (i - 1) / 2)){
+            swap_nodes(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void sift_down(std::size_t i){
+        while(true){
+            std::size_t smallest = i, left = 2 * i + 1, right = left + 1;
+            if(left < heap_.size() && less(left, smallest))
+                smallest = left;
+            if(right < heap_.size() && less(right, smallest))
+                smallest = right;
+            if(smallest == i)
+                return;
+            swap_nodes(i, smallest);
+            i = smallest;
+        }
+    }
+
+    std::size_t capacity_;
+    uint64_t total_ = 0;
+    std::vector<counter> counters_;
+    std::vector<uint32_t> heap_;
+    std::vector<uint32_t> position_;
+    std::unordered_map<Key, uint32_t, Hash> index_;
+};
+
+#endif
@@ -0,0 +1,162 @@
+//build step : turns ATC_tree.csv and ATC_binder_2024.csv into sorted, perfect
+//hashed constexpr tables so that FAERSParser does not read them at startup.
+//usage : embed_tables <ATC_tree.csv> <ATC_binder.csv> <output header>
+//a missing binder file gives an empty binder table (the runtime then needs --atc-binder)
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <string>
+#include <vector>
+#include "../atc_csv.hpp"
+#include "../perfect_hash.hpp"
+
+struct perfect_table{
+    std::vector<std::string> keys; //sorted
+    std::vector<uint32_t> seeds;
+    std::vector<uint32_t> slots;
+};
+
+bool build_perfect_hash(perfect_table& table){
+    std::size_t n = table.keys.size();
+    std::size_t bucket_count = std::max<std::size_t>(1, n / 4);
+    table.seeds.assign(bucket_count, 0);
+    table.slots.assign(std::max<std::size_t>(1, n), 0);
+    if(n == 0)
+        return true;
+
+    std::vector<std::vector<uint32_t>> buckets(bucket_count);
+    for(uint32_t i = 0; i < n; ++i)
+        buckets[table_hash(table.keys[i], 0) % bucket_count].push_back(i);
+
+    //biggest buckets first, they are the hardest to place
+    std::vector<std::size_t> order(bucket_count);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b){
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    std::vector<bool> used(n, false);
+    std::vector<std::size_t> candidate;
+    for(auto b : order){
+        if(buckets[b].empty())
+            break;
+        bool placed = false;
+        for(uint32_t seed = 1; seed < (1u << 24) && !placed; ++seed){
+            candidate.clear();
+            placed = true;
+            for(auto key : buckets[b]){
+                std::size_t slot = table_hash(table.keys[key], seed) % n;
+                if(used[slot] || std::find(candidate.begin(), candidate.end(), slot) != candidate.end()){
+                    placed = false;
+                    break;
+                }
+                candidate.push_back(slot);
+            }
+            if(placed){
+                table.seeds[b] = seed;
+                for(std::size_t i = 0; i < candidate.size(); ++i){
+                    used[candidate[i]] = true;
+                    table.slots[candidate[i]] = buckets[b][i];
+                }
+            }
+        }
+        if(!placed)
+            return false;
+    }
+    return true;
+}
+
+//octal escapes so that the following character can never extend the escape
+std::string cpp_literal(const std::string& s){
+    std::string out = "\"";
+    for(unsigned char c : s){
+        if(c == '"' || c == '\\'){
+            out += '\\';
+            out += c;
+        }else if(c < 0x20 || c >= 0x7f){
+            out += '\\';
+            out += char('0' + (c >> 6));
+            out += char('0' + ((c >> 3) & 7));
+            out += char('0' + (c & 7));
+        }else{
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+template<typename T, typename F>
+void write_array(std::ofstream& ofs, std::string_view type, std::string_view name,
+                 const std::vector<T>& values, F&& format){
+    ofs << "inline constexpr std::array<" << type << ", " << values.size() << "> "
+        << name << "{\n";
+    for(const auto& v : values)
+        ofs << "    " << format(v) << ",\n";
+    ofs << "};\n\n";
+}
+
+void write_table(std::ofstream& ofs, std::string_view prefix, const perfect_table& table){
+    auto number = [](uint32_t v){ return std::to_string(v); };
+    write_array(ofs, "std::string_view", std::string(prefix) + "_keys", table.keys, cpp_literal);
+    write_array(ofs, "uint32_t", std::string(prefix) + "_seeds", table.seeds, number);
+    write_array(ofs, "uint32_t", std::string(prefix) + "_slots", table.slots, number);
+}
+
+int main(int argc, char* argv[]){
+    if(argc != 4){
+        std::cerr << "usage: embed_tables <ATC_tree.csv> <ATC_binder.csv> <output header>\n";
+        return 1;
+    }
+
+    std::ifstream ist_tree(argv[1]);
+    if(!ist_tree.is_open()){
+        std::cerr << "Error opening the ATC tree file: " << argv[1] << "\n";
+        return 1;
+    }
+    auto tree = get_atc_tree_index(ist_tree);
+
+    atc_binder_map binder;
+    std::ifstream ist_binder(argv[2]);
+    if(ist_binder.is_open())
+        binder = get_atc_from_standardized(ist_binder);
+    else
+        std::cerr << "Warning: " << argv[2] << " not found, the embedded ATC binder table is empty.\n";
+
+    perfect_table tree_table, binder_table;
+    std::vector<uint32_t> tree_index;
+    for(const auto& [code, index] : tree){
+        tree_table.keys.push_back(code);
+        tree_index.push_back(index);
+    }
+    std::vector<std::string> binder_codes;
+    for(const auto& [substance, code] : binder){
+        binder_table.keys.push_back(substance);
+        binder_codes.push_back(code);
+    }
+
+    if(!build_perfect_hash(tree_table) || !build_perfect_hash(binder_table)){
+        std::cerr << "Error: could not build the perfect hash tables.\n";
+        return 1;
+    }
+
+    std::ofstream ofs(argv[3]);
+    if(!ofs.is_open()){
+        std::cerr << "Error opening: " << argv[3] << "\n";
+        return 1;
+    }
+    ofs << "//generated by tools/embed_tables.cpp from " << argv[1] << " and " << argv[2]
+        << ", do not edit\n"
+        << "#pragma once\n#include <array>\n#include <cstdint>\n#include <string_view>\n\n"
+        << "namespace embedded_atc{\n\n";
+    write_table(ofs, "tree", tree_table);
+    write_array(ofs, "uint16_t", "tree_index", tree_index,
+                [](uint32_t v){ return std::to_string(v); });
+    write_table(ofs, "binder", binder_table);
+    write_array(ofs, "std::string_view", "binder_codes", binder_codes, cpp_literal);
+    ofs << "}\n";
+
+    return 0;
+}